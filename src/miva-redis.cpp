@@ -1,12 +1,34 @@
+#include <deque>
+#include <list>
+#include <map>
 #include <sstream>
 #include <string>
 #include <string.h>
+#include <utility>
+#include <ctype.h>
+#include <errno.h>
 #include <vector>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <math.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
 
 #include "miva-redis.h"
 
+using std::deque;
+using std::list;
+using std::make_pair;
+using std::map;
+using std::pair;
 using std::string;
 using std::stringstream;
 using std::vector;
@@ -18,13 +40,89 @@ const int ERROR_MALFORMED_COMMAND = 4;
 const int ERROR_COMMAND = 5;
 const int ERROR_REDIS_CONFIG_NOT_FOUND = 6;
 const int ERROR_REDIS_CONFIG_INVALID = 7;
+const int ERROR_UNKNOWN_TARGET = 8;
+const int ERROR_CIRCUIT_OPEN = 9;
+const int ERROR_MALFORMED_VALUE = 10;
+const int ERROR_FILE = 11;
 
-const char *getVariableFromLists(mvVariableList localVars, mvVariableList globalVars, const string &variableName);
+// Key the connection pool is stored under with mvProgram_Register_Persistent
+const char *PERSISTENT_KEY = "miva-redis";
+const int PERSISTENT_KEY_LENGTH = 10;
+
+// A reused connection that has been idle for at least this many seconds is PINGed before use
+const int IDLE_PING_SECONDS = 5;
+
+// Endpoint used when redis.dat has a bare host:port[:db] line, or no target has been selected
+const char *DEFAULT_TARGET = "default";
+
+// System variable set on the first call of each run of a program. The system variables are
+// built afresh for every run and scripts can't assign them, so it tells a new request apart
+// even when it gets the previous one's mvProgram. Reserved, scripts must not rely on it.
+const char *REQUEST_MARKER = "__mivaredis_request";
+const int REQUEST_MARKER_LENGTH = 19;
+
+// mivadata file holding state shared by every VM process on the host
+const char *SHARED_STATE_FILE = "redis.state";
+const int SHARED_STATE_FILE_LENGTH = 11;
+const uint32_t SHARED_STATE_MAGIC = 0x52445331; // "RDS1"
+const int SHARED_BREAKER_SLOTS = 64;
+const int SHARED_MASTER_SLOTS = 16;
+
+// Upper bound on compiled redis_command templates kept per process
+const size_t MAX_COMMAND_TEMPLATES = 512;
+
+// Prefix of values written by redis_set_var, followed by the encoded variable
+const char *VAR_CODEC_MAGIC = "MV\x01";
+const int VAR_CODEC_MAGIC_LENGTH = 3;
+const int VAR_CODEC_MAX_DEPTH = 64;
+
+// Prefix of values compressed by the high level wrappers, followed by the varint
+// uncompressed length and an LZ4 block. The NUL keeps it from matching text values.
+const char *COMPRESS_MAGIC = "\0LZ4";
+const int COMPRESS_MAGIC_LENGTH = 4;
+const uint64_t COMPRESS_MAX_LENGTH = 512 * 1024 * 1024; // redis' own string limit
+
+// mmap'd cache tier shared by every VM process on the host, sized by shared_cache_size
+const char *SHARED_CACHE_FILE = "redis.cache";
+const int SHARED_CACHE_FILE_LENGTH = 11;
+const uint32_t SHARED_CACHE_MAGIC = 0x52444331; // "RDC1"
+const int SHARED_CACHE_PROBES = 8;
+
+// Prefix of values written by redis_cache_fetch, followed by when the value stops being
+// fresh, how long it took to compute, and the value in redis_set_var's format
+const char *CACHE_FETCH_MAGIC = "MVF\x01";
+const int CACHE_FETCH_MAGIC_LENGTH = 4;
+const int CACHE_FETCH_POLL_MILLIS = 50;
+
+// Most redis_get_output reads from the socket at once, so the memory it needs stays the
+// same whatever the size of the value
+const size_t STREAM_CHUNK_SIZE = 65536;
+
+// Temporary keys left by an unfinished redis_append_stream_begin expire after this many seconds
+const int STREAM_TEMP_KEY_TTL = 3600;
+
+// Redis Cluster's hash slots, and how many MOVED/ASK hops a command may take
+const int CLUSTER_SLOTS = 16384;
+const int CLUSTER_MAX_REDIRECTS = 5;
+
+// A slot map found out of date by a MOVED reply is reloaded at most this often
+const int CLUSTER_REFRESH_MILLIS = 1000;
+
+// Points each shard gets on the consistent hash ring, as in ketama
+const int SHARD_RING_POINTS = 160;
+
+// A primary named by the sentinels is taken from redis.state for this long before a failure
+// may ask them again, so an outage costs them one round of questions per host per second
+const int SENTINEL_REFRESH_MILLIS = 1000;
+
+// Channel CLIENT TRACKING ... REDIRECT publishes invalidated keys on
+const char *TRACKING_CHANNEL = "__redis__:invalidate";
 
 extern "C"
 {
 #include "../vendor/hiredis/hiredis.h"
 #include "../vendor/hiredis/sds.h"
+#include "../vendor/lz4/lib/lz4.h"
 
 	enum RedisStatus
 	{
@@ -33,16 +131,358 @@ extern "C"
 		RedisStatus_Unknown
 	};
 
+	enum RedisTopology
+	{
+		RedisTopology_Single,
+		RedisTopology_Cluster,
+		RedisTopology_Sharded
+	};
+
+	enum RedisBreakerState
+	{
+		RedisBreaker_Closed,
+		RedisBreaker_Open,
+		RedisBreaker_HalfOpen
+	};
+
+	/**
+	 * Circuit breaker for one redis server. It lives in the mmap'd redis.state file so an
+	 * outage seen by one VM process makes every other process fail fast too. Fields are
+	 * only touched with atomic builtins.
+	 */
+	struct RedisBreaker
+	{
+		uint32_t key;
+		int32_t state;
+		int32_t failures;
+		int32_t backoff;
+		int64_t retryAt; // wall clock
+	};
+
+	/**
+	 * The primary the sentinels last named for a master, shared so a failover found by one
+	 * VM process moves every other process too. A seqlock like the shared cache slots.
+	 */
+	struct RedisSharedMaster
+	{
+		uint32_t sequence; // odd while a writer owns the slot
+		uint32_t key;
+		int32_t port; // 0 until the sentinels have been asked
+		int32_t reserved;
+		int64_t resolvedAt; // wall clock
+		char host[256];
+	};
+
+	struct RedisSharedState
+	{
+		uint32_t magic;
+		uint32_t size;
+		RedisBreaker breakers[SHARED_BREAKER_SLOTS];
+		RedisSharedMaster masters[SHARED_MASTER_SLOTS];
+	};
+
+	/**
+	 * Cross process cache tier in the mmap'd redis.cache file: an open addressing table of
+	 * slots pointing into a ring arena of key + value records. Each slot is a seqlock, so
+	 * readers never block and a writer that finds a slot busy just doesn't cache. Arena
+	 * positions only grow; a record is intact as long as the head hasn't lapped it, and
+	 * its checksum catches a stalled writer that was lapped finishing a stale copy.
+	 */
+	struct RedisSharedCacheSlot
+	{
+		uint32_t sequence; // odd while a writer owns the slot
+		uint32_t generation;
+		uint64_t hash; // 0 is empty
+		uint64_t position;
+		uint32_t keyLength;
+		uint32_t valueLength;
+		int64_t expiresAt; // wall clock, shared across processes and restarts
+		uint64_t checksum;
+	};
+
+	struct RedisSharedCache
+	{
+		uint32_t magic;
+		uint32_t slotCount;
+		uint64_t arenaSize;
+		uint64_t arenaHead;
+		uint32_t generation; // bumped to empty every slot at once
+		uint32_t reserved;
+
+		// Followed by slotCount slots, then the arena
+	};
+
+	/**
+	 * Tunables from redis.dat. Timeouts and backoffs are in milliseconds, a command
+	 * timeout of 0 waits forever.
+	 */
+	struct RedisOptions
+	{
+		int connectTimeout;
+		int commandTimeout;
+		int failureThreshold;
+		int retryBackoff;
+		int retryBackoffMax;
+
+		// Appended commands are written out once either threshold is reached (0 disables)
+		int pipelineFlushCommands;
+		int pipelineFlushBytes;
+
+		// Replies read ahead for redis_get_reply stop at this many, the rest wait on the
+		// socket until they are taken (0 reads ahead without limit)
+		int pipelineMaxReplies;
+
+		// Values of at least this many bytes are compressed by the high level wrappers (0 disables)
+		int compressThreshold;
+
+		// Keys redis_get keeps in process per endpoint (0 disables), and for how long (0 forever)
+		int localCacheKeys;
+		int localCacheTtl;
+
+		// Arena bytes of the cache shared between processes (0 disables), its slot count and ttl
+		int sharedCacheSize;
+		int sharedCacheSlots;
+		int sharedCacheTtl;
+
+		// redis_cache_fetch: how long values are kept past their ttl to be served while
+		// they are rebuilt, and how long the rebuild lock is held at most
+		int cacheStaleTtl;
+		int cacheLockTimeout;
+	};
+
+	/**
+	 * One step into an aggregate: a struct member (:name) or an array element ([n])
+	 */
+	struct RedisVariableStep
+	{
+		string member;
+		int index;
+	};
+
+	/**
+	 * A variable reference such as l.basket:items[3]:sku, parsed once so it can be
+	 * resolved with a single hashed lookup plus one lookup per step
+	 */
+	struct RedisVariableRef
+	{
+		bool valid;
+		bool global;
+		string name; // l.basket for locals, basket for globals
+		vector<RedisVariableStep> steps;
+	};
+
+	/**
+	 * A redis_command string compiled once: the command split into tokens, with each
+	 * ? placeholder mapped to the variable that fills it.
+	 */
+	struct RedisCommandToken
+	{
+		string literal;
+		int variable; // index into RedisCommandTemplate::variables, or -1 for a literal
+	};
+
+	struct RedisCommandTemplate
+	{
+		vector<RedisCommandToken> tokens;
+		vector<RedisVariableRef> variables;
+		bool cached;
+	};
+
+	/**
+	 * A value cached in process by redis_get, already decompressed
+	 */
+	struct RedisCacheEntry
+	{
+		string value;
+		int64_t expiresAt; // 0 never expires
+		list<string>::iterator order;
+	};
+
+	/**
+	 * A reply still on the wire, wanted unless it's for redis_command_nowait. Cluster nodes
+	 * keep the formatted command too, to resend it if the reply is MOVED or ASK. A chunk
+	 * of redis_append_stream carries the stream's id instead, 0 otherwise.
+	 */
+	struct RedisPendingReply
+	{
+		bool wanted;
+		uint64_t stream;
+		string command;
+	};
+
+	/**
+	 * A single named redis server from redis.dat. Its connection is created the first
+	 * time a request uses the endpoint, and is then kept for later requests.
+	 */
+	struct RedisEndpoint
+	{
+		string name;
+		string host;
+		int port;
+		int databaseIndex;
+
+		redisContext *context;
+		time_t lastUsed;
+
+		// Pipelining: replies still on the wire, how many of those the script wants, commands
+		// not yet written out, replies read ahead but not yet handed to redis_get_reply, and
+		// replies lost to redirects that could not be followed
+		deque<RedisPendingReply> pendingReplies;
+		int wantedReplies;
+		int unflushedCommands;
+		deque<redisReply *> replies;
+		int droppedReplies;
+
+		// The request the endpoint was last used in, to discard what earlier ones left behind
+		uint64_t checkedRequest;
+
+		RedisBreaker *breaker;
+
+		// Local cache, only used while trackingContext is subscribed to the invalidations
+		// redis sends for keys read on context. cacheOrder is most recently used first.
+		map<string, RedisCacheEntry> cache;
+		list<string> cacheOrder;
+		redisContext *trackingContext;
+
+		// Mixed into shared cache hashes, so endpoints on different servers don't collide
+		uint64_t cacheSeed;
+
+		// A cluster target (name.cluster= in redis.dat) never connects itself, its host is
+		// the seed list. Commands go to one of its nodes (by host:port) picked by the slot of
+		// their key. The default node, which loaded the slot map, takes keyless commands.
+		// replyOrder is the node each reply redis_get_reply has to return comes from.
+		// A sharded target (name.shards=) works the same way, except that keys are placed
+		// by the ring and the first node listed is the default.
+		RedisTopology topology;
+		map<string, RedisEndpoint *> nodes;
+		vector<RedisEndpoint *> slots;
+		map<uint32_t, RedisEndpoint *> ring;
+		RedisEndpoint *defaultNode;
+		bool slotsStale;
+		int64_t slotsRefreshedAt;
+		deque<RedisEndpoint *> replyOrder;
+
+		// The cluster or sharded target a node belongs to, or the primary of a replica
+		RedisEndpoint *parent;
+
+		// A single endpoint's replicas (name.replicas= in redis.dat) are its nodes, and reads
+		// go to readNode, the replica picked for the current request. nodeList is the nodes
+		// as redis.dat lists them, to tell whether a reload changed them.
+		RedisEndpoint *readNode;
+		string nodeList;
+
+		// A sentinel endpoint (name.sentinels= in redis.dat) has no host until its sentinels
+		// name the primary of sentinelMaster. The answer is kept in sharedMaster; masterStale
+		// asks again once the primary dropped the connection or replied READONLY.
+		// sentinelIndex is the sentinel that answered last, and is asked first next time.
+		string sentinelMaster;
+		string sentinelList;
+		vector<pair<string, int> > sentinels;
+		size_t sentinelIndex;
+		RedisSharedMaster *sharedMaster;
+		bool masterStale;
+	};
+
+	/**
+	 * One slot's (or shard's) share of a multi-key command split up by scatterRedisCommand
+	 */
+	struct RedisScatterPart
+	{
+		RedisEndpoint *endpoint;
+		string command;
+		vector<int> arguments; // where its keys were in the original command
+		redisReply *reply;
+	};
+
+	/**
+	 * An open redis_output_cache_begin: where redis_output_cache_end stores the content.
+	 * An empty key means the content isn't stored (begin failed).
+	 */
+	struct RedisOutputCapture
+	{
+		string key;
+		int ttl;
+		RedisEndpoint *target;
+	};
+
+	/**
+	 * An open redis_append_stream_begin: chunks are appended to a temporary key that
+	 * redis_append_stream_end renames over the real one. A NULL target means no stream
+	 * is open. failed is set when a chunk's APPEND gets an error reply.
+	 */
+	struct RedisAppendStream
+	{
+		string key;
+		string tempKey;
+		RedisEndpoint *target;
+		uint64_t id;
+		bool failed;
+	};
+
+	/**
+	 * Connection pool that outlives a single program run. It is registered with
+	 * mvProgram_Register_Persistent so a warm VM process reuses the sockets, the
+	 * parsed redis.dat and the SELECTed databases across requests.
+	 */
+	struct RedisPersistentState
+	{
+		map<string, RedisEndpoint *> endpoints;
+		RedisOptions options;
+		int configTime;
+
+		// Keyed by command + '\0' + args
+		map<string, RedisCommandTemplate *> commandTemplates;
+
+		// Either the mmap'd redis.state file, or process local memory if it can't be mapped
+		RedisSharedState *shared;
+		bool sharedMapped;
+
+		// The mmap'd redis.cache file, NULL when shared_cache_size is 0 or it can't be mapped
+		RedisSharedCache *sharedCache;
+		size_t sharedCacheMapSize;
+
+		// The program of the current request, and how many requests this process has begun
+		mvProgram lastProgram;
+		uint64_t requestCount;
+	};
+
 	/**
 	* Globals
 	*/
+	RedisPersistentState *_persistent = NULL;
+
+	// The target selected with redis_target, and the server commands currently go to: the
+	// target itself, or for a cluster the node of the command's key
+	RedisEndpoint *_target = NULL;
+	RedisEndpoint *_endpoint = NULL;
 	redisContext *_connection = NULL;
+
+	// The cluster node or shard a WATCH or MULTI started a transaction on
+	RedisEndpoint *_transactionNode = NULL;
 	string _lastRedisError;
 	int _lastRedisErrorCode = 0;
-	int _redisAppendStackSize = 0;
+
+	// Scratch space reused by every call so the hot path doesn't allocate
+	string _templateKey;
+	vector<const char *> _argv;
+	vector<size_t> _argvlen;
+	string _encodeBuffer;
+	string _compressBuffer;
+	vector<char> _streamBuffer;
 
 	RedisStatus _status = RedisStatus_Unknown;
 
+	// Per request reply conversion settings, see redis_flat_replies
+	bool _flatReplies = false;
+
+	// Per request, keeps reads off the replicas, see redis_require_primary
+	bool _requirePrimary = false;
+	int _lastReplyType = 0;
+
+	// Per request stack of redis_output_cache_begin calls waiting for their end
+	vector<RedisOutputCapture> _outputCaptures;
+	RedisAppendStream _appendStream;
+
 	/**
 	* Helpers
 	*/
@@ -65,226 +505,5275 @@ extern "C"
 		}
 		else if (reply->type == REDIS_REPLY_ARRAY)
 		{
-			const char *varName = "redisreply";
-			for (int i = 0; i < reply->elements; i++)
+			for (size_t i = 0; i < reply->elements; i++)
 			{
-				mvVariable arrVar = mvVariable_Allocate(varName, strlen(varName), "", 0);
+				mvVariable arrVar = mvVariable_Allocate("redisreply", 10, "", 0);
 				formatRedisReply(reply->element[i], arrVar);
-				mvVariable_Set_Array_Element(i, outputVar, arrVar);
+				mvVariable_Set_Array_Element(i + 1, arrVar, outputVar);
 			}
 		}
 	}
 
-	void setRedisError(int code, const string &error, mvProgram program, mvVariable returnValue)
+	/**
+	 * Hands a string reply's buffer to the variable instead of copying it. hiredis
+	 * allocates it with malloc (len + 1 bytes), and the reply no longer owns it.
+	 */
+	void moveRedisReplyString(redisReply *reply, mvVariable outputVar)
 	{
-		_lastRedisError = error;
-		_lastRedisErrorCode = code;
-		mvVariable_SetValue_Integer(returnValue, 0);
-		return;
+		char *str = reply->str;
+		reply->str = NULL;
+		mvVariable_SetValue_Nocopy(outputVar, str, reply->len, reply->len + 1);
 	}
 
-	bool parseRedisArgs(mvProgram program, mvVariable returnValue, const char *command, int commandLength, const char *args, int argsLength, vector<const char *> &argv)
+	/**
+	 * Flat conversion: strings, statuses and errors become plain strings, integers plain
+	 * integers, nil an empty string and multi-bulk replies 1-based arrays of those. There
+	 * is no per-node type struct, and string buffers are moved instead of copied.
+	 */
+	void formatFlatRedisReply(redisReply *reply, mvVariable outputVar)
 	{
-		if (commandLength == 0)
+		if (reply->type == REDIS_REPLY_STATUS || reply->type == REDIS_REPLY_STRING || reply->type == REDIS_REPLY_ERROR)
 		{
-			setRedisError(ERROR_MALFORMED_COMMAND, "Command must be specified!", program, returnValue);
-			return false;
+			moveRedisReplyString(reply, outputVar);
 		}
-
-		// Extract all parts of the command into an array
-		int commandPartCount;
-		sds *commandParts = sdssplitlen(command, commandLength, " ", 1, &commandPartCount);
-		for (int i = 0; i < commandPartCount; i++)
-			sdstrim(commandParts[i], " ");
-
-		// Count substitions...
-		int variableSubCount = 0;
-		for (int i = 0; i < commandPartCount; i++)
+		else if (reply->type == REDIS_REPLY_INTEGER)
 		{
-			if (strcmp(commandParts[i], "?") == 0)
-				variableSubCount++;
+			if (reply->integer >= INT32_MIN && reply->integer <= INT32_MAX)
+			{
+				mvVariable_SetValue_Integer(outputVar, (int)reply->integer);
+			}
+			else
+			{
+				char integer[24];
+				mvVariable_SetValue(outputVar, integer, snprintf(integer, sizeof(integer), "%lld", reply->integer));
+			}
 		}
-
-		// extract all variables from the args parameter
-		int varNameCount;
-		sds *varNames = sdssplitlen(args, argsLength, ",", 1, &varNameCount);
-		for (int i = 0; i < varNameCount; i++)
-			sdstrim(varNames[i], " ");
-
-		if (varNameCount != variableSubCount)
+		else if (reply->type == REDIS_REPLY_ARRAY)
 		{
-			stringstream ss;
-			ss << "Redis command '" << command << "' has " << variableSubCount << " variable substitutions, but you provided " << varNameCount << " variables!";
-			setRedisError(ERROR_MALFORMED_COMMAND, ss.str(), program, returnValue);
+			for (size_t i = 0; i < reply->elements; i++)
+			{
+				mvVariable arrVar = mvVariable_Allocate("redisreply", 10, "", 0);
+				formatFlatRedisReply(reply->element[i], arrVar);
+				mvVariable_Set_Array_Element(i + 1, arrVar, outputVar);
+			}
+		}
+		else
+		{
+			mvVariable_SetValue(outputVar, "", 0);
+		}
+	}
 
-			for (int i = 0; i < commandPartCount; i++)
-				sdsfree(commandParts[i]);
+	/**
+	 * Variable codec used by redis_set_var/redis_get_var. Every value starts with a tag:
+	 *   's' varint length, bytes      'i' zigzag varint      'd' 8 byte double
+	 *   'a' (varint index, value)... 0                       'r' (varint name length, name, value)... 0
+	 */
+	void encodeRedisVarint(string &out, uint64_t value)
+	{
+		while (value >= 0x80)
+		{
+			out.push_back((char)(value | 0x80));
+			value >>= 7;
+		}
 
-			for (int i = 0; i < varNameCount; i++)
-				sdsfree(varNames[i]);
+		out.push_back((char)value);
+	}
 
-			return false;
+	bool decodeRedisVarint(const char *&data, const char *end, uint64_t &value)
+	{
+		value = 0;
+		for (int shift = 0; data < end && shift < 64; shift += 7)
+		{
+			unsigned char byte = *data++;
+			value |= (uint64_t)(byte & 0x7f) << shift;
+			if ((byte & 0x80) == 0)
+				return true;
 		}
 
-		// Load in all varaibles
-		mvVariableList
-			localVars = mvVariableList_Allocate(),
-			globalVars = mvVariableList_Allocate();
-
-		mvProgram_Local_Variables(program, localVars);
-		mvProgram_Global_Variables(program, globalVars);
+		return false;
+	}
 
-		// Combine the var parts with the command parts
-		for (int i = 0, varI = 0; i < commandPartCount; i++)
+	void encodeRedisVariable(string &out, mvVariable var)
+	{
+		int aggregateType = mvVariable_Aggregate_Type(var);
+		if (aggregateType == MVA_ARRAY)
 		{
-			sds commandPart = commandParts[i];
-			if (strcmp(commandPart, "?") != 0)
-			{
-				argv.push_back(commandPart);
-			}
-			else
+			out.push_back('a');
+			for (int index = mvVariable_Array_Min(var); index > 0; )
 			{
-				argv.push_back(getVariableFromLists(localVars, globalVars, varNames[varI++]));
+				mvVariable element = mvVariable_Array_Element(index, var, 0);
+				if (element != NULL)
+				{
+					encodeRedisVarint(out, index);
+					encodeRedisVariable(out, element);
+				}
+
+				int next = mvVariable_Array_Next(var, index);
+				index = next > index ? next : 0;
 			}
+
+			encodeRedisVarint(out, 0);
 		}
+		else if (aggregateType == MVA_STRUCT)
+		{
+			out.push_back('r');
 
-		mvVariableList_Free(localVars);
-		mvVariableList_Free(globalVars);
+			mvVariableList members = mvVariableList_Allocate();
+			mvVariable_Aggregate_List(var, members);
 
-		return true;
+			for (mvVariable member = mvVariableList_First(members); member != NULL; member = mvVariableList_Next(members))
+			{
+				int nameLength = 0;
+				const char *name = mvVariable_Name(member, &nameLength);
+				if (nameLength == 0)
+					continue;
+
+				encodeRedisVarint(out, nameLength);
+				out.append(name, nameLength);
+				encodeRedisVariable(out, member);
+			}
+
+			mvVariableList_Free(members);
+			encodeRedisVarint(out, 0);
+		}
+		else if (mvVariable_Type(var) == MVVTYPE_INTEGER)
+		{
+			int64_t value = mvVariable_Value_Integer(var);
+			out.push_back('i');
+			encodeRedisVarint(out, ((uint64_t)value << 1) ^ (uint64_t)(value >> 63));
+		}
+		else if (mvVariable_Type(var) == MVVTYPE_DOUBLE)
+		{
+			double value = mvVariable_Value_Double(var);
+			out.push_back('d');
+			out.append((const char *)&value, sizeof(value));
+		}
+		else
+		{
+			int valueLength = 0;
+			const char *value = mvVariable_Value(var, &valueLength);
+			out.push_back('s');
+			encodeRedisVarint(out, valueLength);
+			out.append(value, valueLength);
+		}
 	}
 
-	bool isRedisEnabled(mvProgram program, mvVariable returnValue)
+	bool decodeRedisVariable(const char *&data, const char *end, mvVariable var, int depth)
 	{
-		if (_status == RedisStatus_Unknown)
+		if (data >= end || depth > VAR_CODEC_MAX_DEPTH)
+			return false;
+
+		uint64_t length;
+		char tag = *data++;
+		switch (tag)
 		{
-			mvFile redisConfigFile = mvFile_Open(program, MVF_DATA, "redis.dat", 9, MVF_MODE_READ);
+		case 's':
+			if (!decodeRedisVarint(data, end, length) || length > (uint64_t)(end - data))
+				return false;
 
-			if (redisConfigFile == 0)
-			{
-				// file not found
-				setRedisError(ERROR_REDIS_CONFIG_NOT_FOUND, "redis.dat config file not found!", program, returnValue);
-				_status = RedisStatus_Disabled;
+			mvVariable_SetValue(var, data, length);
+			data += length;
+			return true;
+
+		case 'i':
+		{
+			uint64_t zigzag;
+			if (!decodeRedisVarint(data, end, zigzag))
 				return false;
-			}
 
-			long fileLength = mvFile_Length(redisConfigFile);
-			char *buffer = new char[fileLength];
-			mvFile_Read(redisConfigFile, buffer, fileLength);
+			mvVariable_SetValue_Integer(var, (int)((zigzag >> 1) ^ (~(zigzag & 1) + 1)));
+			return true;
+		}
+
+		case 'd':
+		{
+			double value;
+			if ((size_t)(end - data) < sizeof(value))
+				return false;
 
-			int configPartCount;
-			sds *configParts = sdssplitlen(buffer, fileLength, ":", 1, &configPartCount);
+			memcpy(&value, data, sizeof(value));
+			mvVariable_SetValue_Double(var, value);
+			data += sizeof(value);
+			return true;
+		}
 
-			if (configPartCount != 2 && configPartCount != 3)
+		case 'a':
+			mvVariable_SetValue(var, "", 0);
+			for (uint64_t index; decodeRedisVarint(data, end, index); )
 			{
-				setRedisError(ERROR_REDIS_CONFIG_INVALID, "Invalid redis.dat config file!", program, returnValue);
-				_status = RedisStatus_Disabled;
-				return false;
-			}
+				if (index == 0)
+					return true;
 
-			const char *host = configParts[0];
-			int port = atoi(configParts[1]);
+				mvVariable element = mvVariable_Allocate("redisvar", 8, "", 0);
+				if (!decodeRedisVariable(data, end, element, depth + 1))
+				{
+					mvVariable_Free(element);
+					return false;
+				}
 
-			int databaseIndex = 0;
-			if (configPartCount == 3)
-				databaseIndex = atoi(configParts[2]);
+				mvVariable_Set_Array_Element((int)index, element, var);
+			}
+
+			return false;
 
-			timeval timeout = {0, 500000};
-			_connection = redisConnectWithTimeout(host, port, timeout);
-			if (_connection != NULL && _connection->err)
+		case 'r':
+			mvVariable_SetValue(var, "", 0);
+			while (decodeRedisVarint(data, end, length))
 			{
-				setRedisError(ERROR_CONNECT_ERROR, _connection->errstr, program, returnValue);
-				_status = RedisStatus_Disabled;
-				return false;
-			}
+				if (length == 0)
+					return true;
+
+				if (length > (uint64_t)(end - data))
+					return false;
 
-			if (databaseIndex != 0)
-				redisCommand(_connection, "SELECT %d", databaseIndex);
+				const char *name = data;
+				data += length;
 
-			for (int i = 0; i < configPartCount; i++)
-				sdsfree(configParts[i]);
+				mvVariable member = mvVariable_Allocate(name, length, "", 0);
+				if (!decodeRedisVariable(data, end, member, depth + 1))
+				{
+					mvVariable_Free(member);
+					return false;
+				}
+
+				mvVariable_Set_Struct_Member(name, length, member, var);
+			}
 
-			delete[] buffer;
-			_status = RedisStatus_Enabled;
+			return false;
 		}
 
-		return _status == RedisStatus_Enabled;
+		return false;
 	}
 
 	/**
-	 * -----------------------------------------
-	 * redis_is_enabled
-	 * -----------------------------------------
+	 * Compresses a value being stored by a high level wrapper into out. Returns false,
+	 * leaving the value to be sent as is, if compression is off, the value is under
+	 * compress_threshold, or compressing it didn't make it smaller.
 	 */
-	MV_EL_FunctionParameter redis_is_enabled_parameters[] = {
-		{}};
-	void redis_is_enabled(mvProgram program, mvVariableHash parameters, mvVariable returnValue, void **pdata)
+	bool compressRedisValue(const char *value, size_t valueLength, string &out)
 	{
-		mvVariable_SetValue_Integer(returnValue, isRedisEnabled(program, returnValue));
+		int threshold = _persistent->options.compressThreshold;
+		if (threshold <= 0 || valueLength < (size_t)threshold || valueLength > COMPRESS_MAX_LENGTH)
+			return false;
+
+		out.assign(COMPRESS_MAGIC, COMPRESS_MAGIC_LENGTH);
+		encodeRedisVarint(out, valueLength);
+
+		size_t headerLength = out.size();
+		int bound = LZ4_compressBound((int)valueLength);
+		out.resize(headerLength + bound);
+
+		int compressedLength = LZ4_compress_default(value, &out[headerLength], (int)valueLength, bound);
+		if (compressedLength <= 0)
+			return false;
+
+		out.resize(headerLength + compressedLength);
+		return out.size() < valueLength;
+	}
+
+	bool isCompressedRedisValue(const char *value, size_t valueLength)
+	{
+		return valueLength > (size_t)COMPRESS_MAGIC_LENGTH && memcmp(value, COMPRESS_MAGIC, COMPRESS_MAGIC_LENGTH) == 0;
 	}
 
 	/**
-	 * -----------------------------------------
-	 * redis_last_error
-	 * -----------------------------------------
+	 * Expands a value written by compressRedisValue into a malloc'd, NUL terminated
+	 * buffer. Returns NULL if the value is corrupt.
 	 */
-	MV_EL_FunctionParameter redis_error_parameters[] = {
-		{"message", 7, EPF_REFERENCE}};
-	void redis_error(mvProgram program, mvVariableHash parameters, mvVariable returnValue, void **pdata)
+	char *decompressRedisValue(const char *value, size_t valueLength, size_t *decompressedLength)
 	{
-		mvVariable_SetValue_Integer(returnValue, _lastRedisErrorCode);
+		const char *data = value + COMPRESS_MAGIC_LENGTH;
+		const char *end = value + valueLength;
 
-		if (_lastRedisErrorCode != 0)
+		uint64_t length;
+		if (!decodeRedisVarint(data, end, length) || length > COMPRESS_MAX_LENGTH)
+			return NULL;
+
+		char *decompressed = (char *)malloc(length + 1);
+		if (decompressed == NULL)
+			return NULL;
+
+		if (LZ4_decompress_safe(data, decompressed, end - data, (int)length) != (int)length)
+		{
+			free(decompressed);
+			return NULL;
+		}
+
+		decompressed[length] = '\0';
+		*decompressedLength = length;
+		return decompressed;
+	}
+
+	/**
+	 * Places a string reply's value in a variable without copying it, decompressing it
+	 * first if needed. Returns false if a compressed value is corrupt.
+	 */
+	bool moveRedisReplyValue(redisReply *reply, mvVariable outputVar)
+	{
+		if (!isCompressedRedisValue(reply->str, reply->len))
+		{
+			moveRedisReplyString(reply, outputVar);
+			return true;
+		}
+
+		size_t length;
+		char *decompressed = decompressRedisValue(reply->str, reply->len, &length);
+		if (decompressed == NULL)
+			return false;
+
+		mvVariable_SetValue_Nocopy(outputVar, decompressed, length, length + 1);
+		return true;
+	}
+
+	/**
+	 * Converts a reply for the script in the current request's reply mode
+	 */
+	void returnRedisReply(redisReply *reply, mvVariable outputVar)
+	{
+		_lastReplyType = reply->type;
+
+		if (_flatReplies)
+			formatFlatRedisReply(reply, outputVar);
+		else
+			formatRedisReply(reply, outputVar);
+	}
+
+	void recordRedisError(int code, const string &error)
+	{
+		_lastRedisError = error;
+		_lastRedisErrorCode = code;
+	}
+
+	void setRedisError(int code, const string &error, mvProgram program, mvVariable returnValue)
+	{
+		recordRedisError(code, error);
+		if (returnValue != NULL)
+			mvVariable_SetValue_Integer(returnValue, 0);
+		return;
+	}
+
+	/**
+	 * Decodes a (decompressed) value written by redis_set_var into var. Sets the redis
+	 * error and returns false if it wasn't written by redis_set_var or is corrupt.
+	 */
+	bool decodeRedisVarValue(mvProgram program, mvVariable returnValue, const char *value, size_t valueLength, mvVariable var)
+	{
+		if (valueLength < (size_t)VAR_CODEC_MAGIC_LENGTH || memcmp(value, VAR_CODEC_MAGIC, VAR_CODEC_MAGIC_LENGTH) != 0)
+		{
+			setRedisError(ERROR_MALFORMED_VALUE, "Value was not written by redis_set_var!", program, returnValue);
+			return false;
+		}
+
+		const char *data = value + VAR_CODEC_MAGIC_LENGTH;
+		const char *end = value + valueLength;
+		if (!decodeRedisVariable(data, end, var, 0) || data != end)
+		{
+			setRedisError(ERROR_MALFORMED_VALUE, "Value written by redis_set_var is corrupt!", program, returnValue);
+			return false;
+		}
+
+		return true;
+	}
+
+	/**
+	 * Deep copies a variable, including arrays and structures, through the variable codec
+	 */
+	void copyRedisVariable(mvVariable from, mvVariable to)
+	{
+		string buffer;
+		encodeRedisVariable(buffer, from);
+
+		const char *data = buffer.data();
+		decodeRedisVariable(data, data + buffer.size(), to, 0);
+	}
+
+	/**
+	 * Parses l.name or g.name, optionally followed by :member and [index] steps. Names with
+	 * any other scope resolve to an empty string, like they always have.
+	 */
+	bool parseRedisVariable(const char *name, int nameLength, RedisVariableRef &ref)
+	{
+		ref.valid = false;
+		ref.steps.clear();
+
+		if (nameLength < 3 || name[1] != '.' || (name[0] != 'l' && name[0] != 'g'))
+			return true;
+
+		ref.global = name[0] == 'g';
+
+		int i = 2;
+		while (i < nameLength && name[i] != ':' && name[i] != '[')
+			i++;
+
+		if (i == 2)
+			return false;
+
+		ref.name = ref.global ? string(name + 2, i - 2) : string(name, i);
+
+		while (i < nameLength)
+		{
+			RedisVariableStep step;
+			step.index = 0;
+
+			int start = ++i;
+			if (name[start - 1] == ':')
+			{
+				while (i < nameLength && name[i] != ':' && name[i] != '[')
+					i++;
+
+				if (i == start)
+					return false;
+
+				step.member.assign(name + start, i - start);
+			}
+			else
+			{
+				while (i < nameLength && name[i] >= '0' && name[i] <= '9')
+					step.index = step.index * 10 + (name[i++] - '0');
+
+				if (i == start || i == nameLength || name[i] != ']')
+					return false;
+
+				i++;
+			}
+
+			ref.steps.push_back(step);
+		}
+
+		ref.valid = true;
+		return true;
+	}
+
+	/**
+	 * Looks a variable up directly: locals through mvProgram_Lookup_Variable, globals in the
+	 * global variable hash, then walks any struct/array steps. Missing variables resolve to
+	 * an empty string.
+	 */
+	const char *resolveRedisVariable(mvProgram program, const RedisVariableRef &ref, int *valueLength)
+	{
+		*valueLength = 0;
+		if (!ref.valid)
+			return "";
+
+		mvVariable var;
+		if (ref.global)
+			var = mvVariableHash_Find(mvProgram_Global_VariableHash(program), ref.name.data(), ref.name.size());
+		else
+			var = mvProgram_Lookup_Variable(program, ref.name.data(), ref.name.size());
+
+		for (size_t i = 0; var != NULL && i < ref.steps.size(); i++)
+		{
+			const RedisVariableStep &step = ref.steps[i];
+			if (step.member.size() > 0)
+				var = mvVariable_Struct_Member(step.member.data(), step.member.size(), var, 0);
+			else
+				var = mvVariable_Array_Element(step.index, var, 0);
+		}
+
+		if (var == NULL)
+			return "";
+
+		return mvVariable_Value(var, valueLength);
+	}
+
+	RedisCommandTemplate *compileRedisCommand(mvProgram program, mvVariable returnValue, const char *command, int commandLength, const char *args, int argsLength)
+	{
+		if (commandLength == 0)
+		{
+			setRedisError(ERROR_MALFORMED_COMMAND, "Command must be specified!", program, returnValue);
+			return NULL;
+		}
+
+		RedisCommandTemplate *commandTemplate = new RedisCommandTemplate();
+		commandTemplate->cached = false;
+
+		// extract all variables from the args parameter
+		int varNameCount;
+		sds *varNames = sdssplitlen(args, argsLength, ",", 1, &varNameCount);
+		commandTemplate->variables.resize(varNameCount);
+
+		bool validVariables = true;
+		for (int i = 0; i < varNameCount && validVariables; i++)
+		{
+			sds varName = sdstrim(varNames[i], " ");
+			validVariables = parseRedisVariable(varName, sdslen(varName), commandTemplate->variables[i]);
+		}
+
+		sdsfreesplitres(varNames, varNameCount);
+
+		if (!validVariables)
+		{
+			setRedisError(ERROR_MALFORMED_COMMAND, "Redis command '" + string(command, commandLength) + "' has an invalid variable name in '" + string(args, argsLength) + "'!", program, returnValue);
+
+			delete commandTemplate;
+			return NULL;
+		}
+
+		// Extract all parts of the command, noting which ones are substitutions
+		int commandPartCount;
+		sds *commandParts = sdssplitlen(command, commandLength, " ", 1, &commandPartCount);
+
+		int variableSubCount = 0;
+		for (int i = 0; i < commandPartCount; i++)
+		{
+			if (sdslen(commandParts[i]) == 0)
+				continue;
+
+			RedisCommandToken token;
+			token.variable = -1;
+
+			if (strcmp(commandParts[i], "?") == 0)
+				token.variable = variableSubCount++;
+			else
+				token.literal.assign(commandParts[i], sdslen(commandParts[i]));
+
+			commandTemplate->tokens.push_back(token);
+		}
+
+		sdsfreesplitres(commandParts, commandPartCount);
+
+		if (commandTemplate->variables.size() != (size_t)variableSubCount)
+		{
+			stringstream ss;
+			ss << "Redis command '" << string(command, commandLength) << "' has " << variableSubCount << " variable substitutions, but you provided " << commandTemplate->variables.size() << " variables!";
+			setRedisError(ERROR_MALFORMED_COMMAND, ss.str(), program, returnValue);
+
+			delete commandTemplate;
+			return NULL;
+		}
+
+		if (commandTemplate->tokens.size() == 0)
+		{
+			setRedisError(ERROR_MALFORMED_COMMAND, "Blank command?!", program, returnValue);
+
+			delete commandTemplate;
+			return NULL;
+		}
+
+		return commandTemplate;
+	}
+
+	/**
+	 * Returns the compiled template for command/args, compiling and caching it on first use.
+	 * Once the cache is full, new commands are compiled for a single use; release them with
+	 * releaseRedisCommandTemplate.
+	 */
+	RedisCommandTemplate *getRedisCommandTemplate(mvProgram program, mvVariable returnValue, const char *command, int commandLength, const char *args, int argsLength)
+	{
+		_templateKey.assign(command, commandLength);
+		_templateKey.push_back('\0');
+		_templateKey.append(args, argsLength);
+
+		map<string, RedisCommandTemplate *>::iterator it = _persistent->commandTemplates.find(_templateKey);
+		if (it != _persistent->commandTemplates.end())
+			return it->second;
+
+		RedisCommandTemplate *commandTemplate = compileRedisCommand(program, returnValue, command, commandLength, args, argsLength);
+		if (commandTemplate != NULL && _persistent->commandTemplates.size() < MAX_COMMAND_TEMPLATES)
+		{
+			commandTemplate->cached = true;
+			_persistent->commandTemplates[_templateKey] = commandTemplate;
+		}
+
+		return commandTemplate;
+	}
+
+	void releaseRedisCommandTemplate(RedisCommandTemplate *commandTemplate)
+	{
+		if (!commandTemplate->cached)
+			delete commandTemplate;
+	}
+
+	/**
+	 * Fills _argv/_argvlen from a template, substituting the current variable values
+	 */
+	void buildRedisArgv(mvProgram program, RedisCommandTemplate *commandTemplate)
+	{
+		_argv.clear();
+		_argvlen.clear();
+
+		for (size_t i = 0; i < commandTemplate->tokens.size(); i++)
+		{
+			const RedisCommandToken &token = commandTemplate->tokens[i];
+			if (token.variable < 0)
+			{
+				_argv.push_back(token.literal.data());
+				_argvlen.push_back(token.literal.size());
+			}
+			else
+			{
+				int valueLength = 0;
+				_argv.push_back(resolveRedisVariable(program, commandTemplate->variables[token.variable], &valueLength));
+				_argvlen.push_back(valueLength);
+			}
+		}
+	}
+
+	/**
+	 * Appends the elements of a Miva array to _argv/_argvlen in index order, and their
+	 * indexes to indexes (if given)
+	 */
+	void appendRedisArgvFromArray(mvVariable array, vector<int> *indexes)
+	{
+		for (int index = mvVariable_Array_Min(array); index > 0; )
+		{
+			mvVariable element = mvVariable_Array_Element(index, array, 0);
+			if (element != NULL)
+			{
+				int valueLength = 0;
+				_argv.push_back(mvVariable_Value(element, &valueLength));
+				_argvlen.push_back(valueLength);
+
+				if (indexes != NULL)
+					indexes->push_back(index);
+			}
+
+			int next = mvVariable_Array_Next(array, index);
+			index = next > index ? next : 0;
+		}
+	}
+
+	/**
+	 * Fills _argv/_argvlen from the elements of a Miva array, in index order. Returns false
+	 * if the variable isn't an array with at least one element.
+	 */
+	bool buildRedisArgvFromArray(mvVariable array)
+	{
+		_argv.clear();
+		_argvlen.clear();
+
+		if (mvVariable_Aggregate_Type(array) != MVA_ARRAY)
+			return false;
+
+		appendRedisArgvFromArray(array, NULL);
+		return _argv.size() > 0;
+	}
+
+	void clearRedisPipeline(RedisEndpoint *endpoint)
+	{
+		for (size_t i = 0; i < endpoint->replies.size(); i++)
+			freeReplyObject(endpoint->replies[i]);
+
+		endpoint->replies.clear();
+		endpoint->pendingReplies.clear();
+		endpoint->wantedReplies = 0;
+		endpoint->unflushedCommands = 0;
+		endpoint->droppedReplies = 0;
+		endpoint->replyOrder.clear();
+	}
+
+	/**
+	 * Drops the local cache along with the tracking connection that kept it coherent
+	 */
+	void clearRedisCache(RedisEndpoint *endpoint)
+	{
+		if (endpoint->trackingContext != NULL)
+		{
+			redisFree(endpoint->trackingContext);
+			endpoint->trackingContext = NULL;
+		}
+
+		endpoint->cache.clear();
+		endpoint->cacheOrder.clear();
+	}
+
+	/**
+	 * Splits a comma separated list of names, trimming spaces and skipping empty names
+	 */
+	void splitRedisNames(const char *names, int namesLength, vector<string> &result)
+	{
+		int nameCount;
+		sds *parts = sdssplitlen(names, namesLength, ",", 1, &nameCount);
+
+		for (int i = 0; i < nameCount; i++)
+		{
+			sds name = sdstrim(parts[i], " ");
+			if (sdslen(name) > 0)
+				result.push_back(string(name, sdslen(name)));
+		}
+
+		sdsfreesplitres(parts, nameCount);
+	}
+
+	void freeRedisConnection(RedisEndpoint *endpoint)
+	{
+		if (endpoint->context != NULL)
+		{
+			redisFree(endpoint->context);
+			endpoint->context = NULL;
+		}
+
+		if (endpoint == _endpoint)
+			_connection = NULL;
+
+		clearRedisPipeline(endpoint);
+
+		// Tracking belongs to the connection, so the cache can't be trusted past it
+		clearRedisCache(endpoint);
+	}
+
+	void freeRedisEndpoint(RedisEndpoint *endpoint)
+	{
+		for (map<string, RedisEndpoint *>::iterator it = endpoint->nodes.begin(); it != endpoint->nodes.end(); it++)
+			freeRedisEndpoint(it->second);
+
+		clearRedisPipeline(endpoint);
+		clearRedisCache(endpoint);
+
+		if (endpoint->context != NULL)
+		{
+			// Deliver commands still sitting in the output buffer, e.g. from redis_command_nowait
+			int done = 0;
+			while (!endpoint->context->err && !done && redisBufferWrite(endpoint->context, &done) == REDIS_OK)
+				;
+
+			redisFree(endpoint->context);
+		}
+
+		delete endpoint;
+	}
+
+	void freeRedisEndpoints(RedisPersistentState *persistent)
+	{
+		for (map<string, RedisEndpoint *>::iterator it = persistent->endpoints.begin(); it != persistent->endpoints.end(); it++)
+			freeRedisEndpoint(it->second);
+
+		persistent->endpoints.clear();
+	}
+
+	void unmapSharedCache(RedisPersistentState *persistent)
+	{
+		if (persistent->sharedCache != NULL)
+		{
+			munmap(persistent->sharedCache, persistent->sharedCacheMapSize);
+			persistent->sharedCache = NULL;
+		}
+	}
+
+	void cleanupPersistentState(mvProgram program, void *data)
+	{
+		RedisPersistentState *persistent = (RedisPersistentState *)data;
+		freeRedisEndpoints(persistent);
+
+		for (map<string, RedisCommandTemplate *>::iterator it = persistent->commandTemplates.begin(); it != persistent->commandTemplates.end(); it++)
+			delete it->second;
+
+		if (persistent->sharedMapped)
+			munmap(persistent->shared, sizeof(RedisSharedState));
+		else
+			delete persistent->shared;
+
+		unmapSharedCache(persistent);
+
+		if (_persistent == persistent)
+		{
+			_persistent = NULL;
+			_target = NULL;
+			_endpoint = NULL;
+			_connection = NULL;
+		}
+
+		delete persistent;
+	}
+
+	void setDefaultRedisOptions(RedisOptions &options)
+	{
+		options.connectTimeout = 500;
+		options.commandTimeout = 0;
+		options.failureThreshold = 3;
+		options.retryBackoff = 1000;
+		options.retryBackoffMax = 30000;
+		options.pipelineFlushCommands = 1000;
+		options.pipelineFlushBytes = 1024 * 1024;
+		options.pipelineMaxReplies = 1000;
+		options.compressThreshold = 0;
+		options.localCacheKeys = 0;
+		options.localCacheTtl = 60000;
+		options.sharedCacheSize = 0;
+		options.sharedCacheSlots = 16384;
+		options.sharedCacheTtl = 5000;
+		options.cacheStaleTtl = 60000;
+		options.cacheLockTimeout = 10000;
+	}
+
+	/**
+	 * Maps mivadata/redis.state, creating it if needed. Falls back to process local memory
+	 * so the breaker still works (per process) when the file can't be shared.
+	 */
+	void mapSharedState(mvProgram program, RedisPersistentState *persistent)
+	{
+		char *path = NULL;
+		int pathLength = 0;
+		if (mvFile_Resolve(program, MVF_DATA, SHARED_STATE_FILE, SHARED_STATE_FILE_LENGTH, &path, &pathLength) && path != NULL)
+		{
+			int fd = open(path, O_RDWR | O_CREAT, 0660);
+			free(path);
+
+			struct stat info;
+			if (fd >= 0 && fstat(fd, &info) == 0 && (info.st_size >= (off_t)sizeof(RedisSharedState) || ftruncate(fd, sizeof(RedisSharedState)) == 0))
+			{
+				void *mapped = mmap(NULL, sizeof(RedisSharedState), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+				if (mapped != MAP_FAILED)
+				{
+					RedisSharedState *shared = (RedisSharedState *)mapped;
+					__sync_bool_compare_and_swap(&shared->magic, 0, SHARED_STATE_MAGIC);
+					__sync_bool_compare_and_swap(&shared->size, 0, sizeof(RedisSharedState));
+
+					// A file from before the masters were added is a prefix of this layout, and
+					// ftruncate has just zero filled the rest
+					__sync_bool_compare_and_swap(&shared->size, offsetof(RedisSharedState, masters), sizeof(RedisSharedState));
+
+					if (shared->magic == SHARED_STATE_MAGIC && shared->size == sizeof(RedisSharedState))
+					{
+						persistent->shared = shared;
+						persistent->sharedMapped = true;
+					}
+					else
+					{
+						munmap(mapped, sizeof(RedisSharedState));
+					}
+				}
+			}
+
+			if (fd >= 0)
+				close(fd);
+		}
+
+		if (persistent->shared == NULL)
+		{
+			persistent->shared = new RedisSharedState();
+			memset(persistent->shared, 0, sizeof(RedisSharedState));
+		}
+	}
+
+	/**
+	 * Maps mivadata/redis.cache for the configured shared_cache_size and shared_cache_slots.
+	 * A file laid out for other sizes is replaced rather than resized: the new one is
+	 * built under a temporary name and renamed into place, so processes still mapping the
+	 * old file keep using it until they reload redis.dat.
+	 */
+	void mapSharedCache(mvProgram program, RedisPersistentState *persistent)
+	{
+		const RedisOptions &options = persistent->options;
+		RedisSharedCache *cache = persistent->sharedCache;
+		if (cache != NULL && cache->slotCount == (uint32_t)options.sharedCacheSlots && cache->arenaSize == (uint64_t)options.sharedCacheSize)
+			return;
+
+		unmapSharedCache(persistent);
+		if (options.sharedCacheSize <= 0 || options.sharedCacheSlots <= 0)
+			return;
+
+		char *path = NULL;
+		int pathLength = 0;
+		if (!mvFile_Resolve(program, MVF_DATA, SHARED_CACHE_FILE, SHARED_CACHE_FILE_LENGTH, &path, &pathLength) || path == NULL)
+			return;
+
+		RedisSharedCache header;
+		memset(&header, 0, sizeof(header));
+		header.magic = SHARED_CACHE_MAGIC;
+		header.slotCount = options.sharedCacheSlots;
+		header.arenaSize = options.sharedCacheSize;
+
+		size_t size = sizeof(RedisSharedCache) + (size_t)options.sharedCacheSlots * sizeof(RedisSharedCacheSlot) + (size_t)options.sharedCacheSize;
+		for (int attempt = 0; attempt < 2; attempt++)
+		{
+			int fd = open(path, O_RDWR);
+
+			struct stat info;
+			if (fd >= 0 && fstat(fd, &info) == 0 && info.st_size == (off_t)size)
+			{
+				void *mapped = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+				if (mapped != MAP_FAILED)
+				{
+					cache = (RedisSharedCache *)mapped;
+					if (cache->magic == header.magic && cache->slotCount == header.slotCount && cache->arenaSize == header.arenaSize)
+					{
+						persistent->sharedCache = cache;
+						persistent->sharedCacheMapSize = size;
+					}
+					else
+					{
+						munmap(mapped, size);
+					}
+				}
+			}
+
+			if (fd >= 0)
+				close(fd);
+
+			if (persistent->sharedCache != NULL || attempt > 0)
+				break;
+
+			// Missing or laid out for other options: put a fresh one in place, then map whichever
+			// file won if several processes raced to do the same
+			char temporary[4096];
+			snprintf(temporary, sizeof(temporary), "%s.%d", path, (int)getpid());
+
+			fd = open(temporary, O_RDWR | O_CREAT | O_TRUNC, 0660);
+			if (fd < 0)
+				break;
+
+			bool created = ftruncate(fd, size) == 0 && pwrite(fd, &header, sizeof(header), 0) == (ssize_t)sizeof(header);
+			close(fd);
+
+			if (!created || rename(temporary, path) != 0)
+			{
+				unlink(temporary);
+				break;
+			}
+		}
+
+		free(path);
+	}
+
+	int64_t currentTimeMillis()
+	{
+		timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		return (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+	}
+
+	int64_t wallTimeMillis()
+	{
+		timespec now;
+		clock_gettime(CLOCK_REALTIME, &now);
+		return (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+	}
+
+	/**
+	 * xorshift64*, seeded per process so workers don't make the same choices in lockstep
+	 * (and without touching the host's rand() state)
+	 */
+	uint64_t randomRedisNumber()
+	{
+		static uint64_t state = 0;
+		if (state == 0)
+			state = ((uint64_t)getpid() << 32) ^ (uint64_t)wallTimeMillis() ^ 0x9e3779b97f4a7c15ull;
+
+		state ^= state >> 12;
+		state ^= state << 25;
+		state ^= state >> 27;
+		return state * 2685821657736338717ull;
+	}
+
+	timeval millisToTimeval(int millis)
+	{
+		timeval tv = {millis / 1000, (millis % 1000) * 1000};
+		return tv;
+	}
+
+	void setRedisCommandTimeout(redisContext *context)
+	{
+		redisSetTimeout(context, millisToTimeval(_persistent->options.commandTimeout));
+	}
+
+	uint32_t hashString(const char *data, int length)
+	{
+		// FNV-1a
+		uint32_t hash = 2166136261u;
+		for (int i = 0; i < length; i++)
+		{
+			hash ^= (unsigned char)data[i];
+			hash *= 16777619u;
+		}
+
+		return hash;
+	}
+
+	/**
+	 * CRC16-CCITT (XMODEM), which Redis Cluster maps keys to slots with
+	 */
+	uint16_t crc16(const char *data, size_t length)
+	{
+		static uint16_t table[256];
+		static bool initialized = false;
+		if (!initialized)
+		{
+			for (int i = 0; i < 256; i++)
+			{
+				uint16_t crc = i << 8;
+				for (int bit = 0; bit < 8; bit++)
+					crc = crc & 0x8000 ? (crc << 1) ^ 0x1021 : crc << 1;
+
+				table[i] = crc;
+			}
+
+			initialized = true;
+		}
+
+		uint16_t crc = 0;
+		for (size_t i = 0; i < length; i++)
+			crc = (crc << 8) ^ table[((crc >> 8) ^ (unsigned char)data[i]) & 0xff];
+
+		return crc;
+	}
+
+	/**
+	 * The part of a key that is hashed to place it: the first non-empty {...} section, so
+	 * related keys can be kept together, or else the whole key
+	 */
+	const char *findRedisHashTag(const char *key, size_t keyLength, size_t *tagLength)
+	{
+		const char *open = (const char *)memchr(key, '{', keyLength);
+		if (open != NULL)
+		{
+			const char *close = (const char *)memchr(open + 1, '}', key + keyLength - open - 1);
+			if (close != NULL && close > open + 1)
+			{
+				*tagLength = close - open - 1;
+				return open + 1;
+			}
+		}
+
+		*tagLength = keyLength;
+		return key;
+	}
+
+	int getRedisClusterSlot(const char *key, size_t keyLength)
+	{
+		size_t tagLength;
+		const char *tag = findRedisHashTag(key, keyLength, &tagLength);
+		return crc16(tag, tagLength) & (CLUSTER_SLOTS - 1);
+	}
+
+	/**
+	 * Position of a key, or of a shard's point, on the consistent hash ring: FNV-1a 64
+	 * with MurmurHash3's finalizer, as keys that differ only at the end (product:1,
+	 * product:2, ...) would otherwise bunch up
+	 */
+	uint32_t hashRedisRingKey(const char *key, size_t keyLength)
+	{
+		uint64_t hash = 14695981039346656037ull;
+		for (size_t i = 0; i < keyLength; i++)
+		{
+			hash ^= (unsigned char)key[i];
+			hash *= 1099511628211ull;
+		}
+
+		hash ^= hash >> 33;
+		hash *= 0xff51afd7ed558ccdull;
+		hash ^= hash >> 33;
+		hash *= 0xc4ceb9fe1a85ec53ull;
+		hash ^= hash >> 33;
+		return (uint32_t)(hash >> 32);
+	}
+
+	/**
+	 * FNV-1a 64 of a key, continuing from the endpoint's seed. Never 0, which marks an
+	 * empty slot.
+	 */
+	uint64_t hashSharedCacheKey(uint64_t seed, const char *key, int keyLength)
+	{
+		uint64_t hash = seed;
+		for (int i = 0; i < keyLength; i++)
+		{
+			hash ^= (unsigned char)key[i];
+			hash *= 1099511628211ull;
+		}
+
+		return hash != 0 ? hash : 1;
+	}
+
+	/**
+	 * Finds (or claims) the shared breaker slot for host:port
+	 */
+	RedisBreaker *findRedisBreaker(const string &host, int port)
+	{
+		stringstream ss;
+		ss << host << ":" << port;
+		string address = ss.str();
+
+		uint32_t key = hashString(address.c_str(), address.size());
+		if (key == 0)
+			key = 1;
+
+		RedisBreaker *breakers = _persistent->shared->breakers;
+		for (int i = 0; i < SHARED_BREAKER_SLOTS; i++)
+		{
+			RedisBreaker *breaker = &breakers[(key + i) % SHARED_BREAKER_SLOTS];
+			if (breaker->key == key || __sync_bool_compare_and_swap(&breaker->key, 0, key) || breaker->key == key)
+				return breaker;
+		}
+
+		// Every slot is taken, share the home slot with whoever owns it
+		return &breakers[key % SHARED_BREAKER_SLOTS];
+	}
+
+	/**
+	 * Keys a master by the sentinels too, as two groups of sentinels may well use the same
+	 * master name
+	 */
+	uint32_t hashRedisSentinelMaster(RedisEndpoint *endpoint)
+	{
+		string master = endpoint->sentinelMaster + "@" + endpoint->sentinelList;
+		uint32_t key = hashString(master.c_str(), master.size());
+		return key != 0 ? key : 1;
+	}
+
+	/**
+	 * Finds (or claims) the shared slot for a sentinel endpoint's master
+	 */
+	RedisSharedMaster *findRedisSharedMaster(RedisEndpoint *endpoint)
+	{
+		uint32_t key = hashRedisSentinelMaster(endpoint);
+
+		RedisSharedMaster *masters = _persistent->shared->masters;
+		for (int i = 0; i < SHARED_MASTER_SLOTS; i++)
+		{
+			RedisSharedMaster *slot = &masters[(key + i) % SHARED_MASTER_SLOTS];
+			if (slot->key == key || __sync_bool_compare_and_swap(&slot->key, 0, key) || slot->key == key)
+				return slot;
+		}
+
+		// Sharing a slot only costs a visit to the sentinels, readSharedRedisMaster checks the key
+		return &masters[key % SHARED_MASTER_SLOTS];
+	}
+
+	/**
+	 * Copies the primary out of a shared master slot. Returns false if the sentinels
+	 * haven't been asked yet, or a writer got in the way.
+	 */
+	bool readSharedRedisMaster(RedisEndpoint *endpoint, string &host, int &port, int64_t &resolvedAt)
+	{
+		RedisSharedMaster *slot = endpoint->sharedMaster;
+
+		uint32_t sequence = *(volatile uint32_t *)&slot->sequence;
+		__sync_synchronize();
+
+		RedisSharedMaster copy = *slot;
+		__sync_synchronize();
+
+		if ((sequence & 1) || *(volatile uint32_t *)&slot->sequence != sequence)
+			return false;
+
+		if (copy.port <= 0 || copy.key != hashRedisSentinelMaster(endpoint))
+			return false;
+
+		copy.host[sizeof(copy.host) - 1] = '\0';
+		host = copy.host;
+		port = copy.port;
+		resolvedAt = copy.resolvedAt;
+		return true;
+	}
+
+	void writeSharedRedisMaster(RedisEndpoint *endpoint, const string &host, int port)
+	{
+		RedisSharedMaster *slot = endpoint->sharedMaster;
+		if (host.size() >= sizeof(slot->host))
+			return;
+
+		// Another process is writing the same answer, or one just as fresh
+		uint32_t sequence = *(volatile uint32_t *)&slot->sequence;
+		if ((sequence & 1) || !__sync_bool_compare_and_swap(&slot->sequence, sequence, sequence + 1))
+			return;
+
+		slot->key = hashRedisSentinelMaster(endpoint);
+		slot->port = port;
+		slot->resolvedAt = wallTimeMillis();
+		memcpy(slot->host, host.c_str(), host.size() + 1);
+
+		__sync_synchronize();
+		*(volatile uint32_t *)&slot->sequence = sequence + 2;
+	}
+
+	/**
+	 * Returns false while the circuit is open. Once the backoff has elapsed exactly one
+	 * process wins the retryAt compare-and-swap and gets to probe the server (half-open).
+	 * retryAt is wall clock time, as redis.state outlives reboots. One further ahead than
+	 * any backoff or probe lease (the clock was stepped back) counts as elapsed.
+	 */
+	bool allowRedisAttempt(RedisBreaker *breaker)
+	{
+		if (breaker->state == RedisBreaker_Closed)
+			return true;
+
+		const RedisOptions &options = _persistent->options;
+		int64_t probeMillis = options.connectTimeout + options.commandTimeout;
+		int64_t now = wallTimeMillis();
+		int64_t retryAt = breaker->retryAt;
+		if (now < retryAt && retryAt - now <= (probeMillis > options.retryBackoffMax ? probeMillis : options.retryBackoffMax))
+			return false;
+
+		// Hold the probe for one connect timeout plus one command timeout before letting someone else try
+		int64_t lease = now + probeMillis;
+		if (!__sync_bool_compare_and_swap(&breaker->retryAt, retryAt, lease))
+			return false;
+
+		__sync_lock_test_and_set(&breaker->state, RedisBreaker_HalfOpen);
+		return true;
+	}
+
+	void recordRedisSuccess(RedisBreaker *breaker)
+	{
+		if (breaker->state == RedisBreaker_Closed && breaker->failures == 0)
+			return;
+
+		__sync_lock_test_and_set(&breaker->failures, 0);
+		__sync_lock_test_and_set(&breaker->backoff, 0);
+		__sync_lock_test_and_set(&breaker->state, RedisBreaker_Closed);
+	}
+
+	void recordRedisFailure(RedisBreaker *breaker)
+	{
+		const RedisOptions &options = _persistent->options;
+
+		int failures = __sync_add_and_fetch(&breaker->failures, 1);
+		if (breaker->state != RedisBreaker_HalfOpen && failures < options.failureThreshold)
+			return;
+
+		// Trip (or re-trip after a failed probe), doubling the backoff each time
+		int backoff = breaker->backoff * 2;
+		if (backoff < options.retryBackoff)
+			backoff = options.retryBackoff;
+		if (backoff > options.retryBackoffMax)
+			backoff = options.retryBackoffMax;
+
+		__sync_lock_test_and_set(&breaker->backoff, backoff);
+		__sync_lock_test_and_set(&breaker->retryAt, wallTimeMillis() + backoff);
+		__sync_lock_test_and_set(&breaker->state, RedisBreaker_Open);
+	}
+
+	RedisPersistentState *getPersistentState(mvProgram program)
+	{
+		if (_persistent != NULL)
+			return _persistent;
+
+		_persistent = (RedisPersistentState *)mvProgram_Lookup_Persistent(program, PERSISTENT_KEY, PERSISTENT_KEY_LENGTH);
+		if (_persistent == NULL)
+		{
+			_persistent = new RedisPersistentState();
+			_persistent->configTime = 0;
+			_persistent->shared = NULL;
+			_persistent->sharedMapped = false;
+			_persistent->sharedCache = NULL;
+			_persistent->sharedCacheMapSize = 0;
+			_persistent->lastProgram = NULL;
+			_persistent->requestCount = 0;
+			setDefaultRedisOptions(_persistent->options);
+			mapSharedState(program, _persistent);
+
+			mvProgram_Register_Persistent(program, PERSISTENT_KEY, PERSISTENT_KEY_LENGTH, _persistent, cleanupPersistentState);
+		}
+
+		return _persistent;
+	}
+
+	/**
+	 * Parses a host:port[:db] address
+	 */
+	bool parseRedisAddress(const char *address, int addressLength, RedisEndpoint *endpoint)
+	{
+		int addressPartCount;
+		sds *addressParts = sdssplitlen(address, addressLength, ":", 1, &addressPartCount);
+
+		if (addressPartCount != 2 && addressPartCount != 3)
+		{
+			sdsfreesplitres(addressParts, addressPartCount);
+			return false;
+		}
+
+		endpoint->host = sdstrim(addressParts[0], " \t");
+		endpoint->port = atoi(addressParts[1]);
+		endpoint->databaseIndex = addressPartCount == 3 ? atoi(addressParts[2]) : 0;
+
+		sdsfreesplitres(addressParts, addressPartCount);
+		return endpoint->host.size() > 0 && endpoint->port > 0;
+	}
+
+	/**
+	 * Sets a name=value tunable, returns false if the name isn't a known option
+	 */
+	bool parseRedisOption(const string &name, const char *value, RedisOptions &options)
+	{
+		int *option = NULL;
+		if (name == "connect_timeout")
+			option = &options.connectTimeout;
+		else if (name == "command_timeout")
+			option = &options.commandTimeout;
+		else if (name == "failure_threshold")
+			option = &options.failureThreshold;
+		else if (name == "retry_backoff")
+			option = &options.retryBackoff;
+		else if (name == "retry_backoff_max")
+			option = &options.retryBackoffMax;
+		else if (name == "pipeline_flush_commands")
+			option = &options.pipelineFlushCommands;
+		else if (name == "pipeline_flush_bytes")
+			option = &options.pipelineFlushBytes;
+		else if (name == "pipeline_max_replies")
+			option = &options.pipelineMaxReplies;
+		else if (name == "compress_threshold")
+			option = &options.compressThreshold;
+		else if (name == "local_cache_keys")
+			option = &options.localCacheKeys;
+		else if (name == "local_cache_ttl")
+			option = &options.localCacheTtl;
+		else if (name == "shared_cache_size")
+			option = &options.sharedCacheSize;
+		else if (name == "shared_cache_slots")
+			option = &options.sharedCacheSlots;
+		else if (name == "shared_cache_ttl")
+			option = &options.sharedCacheTtl;
+		else if (name == "cache_stale_ttl")
+			option = &options.cacheStaleTtl;
+		else if (name == "cache_lock_timeout")
+			option = &options.cacheLockTimeout;
+		else
+			return false;
+
+		*option = atoi(value);
+		return true;
+	}
+
+	RedisEndpoint *newRedisEndpoint(const string &name)
+	{
+		RedisEndpoint *endpoint = new RedisEndpoint();
+		endpoint->name = name;
+		endpoint->port = 0;
+		endpoint->databaseIndex = 0;
+		endpoint->context = NULL;
+		endpoint->lastUsed = 0;
+		endpoint->wantedReplies = 0;
+		endpoint->unflushedCommands = 0;
+		endpoint->droppedReplies = 0;
+		endpoint->checkedRequest = 0;
+		endpoint->breaker = NULL;
+		endpoint->trackingContext = NULL;
+		endpoint->cacheSeed = 0;
+		endpoint->topology = RedisTopology_Single;
+		endpoint->defaultNode = NULL;
+		endpoint->slotsStale = true;
+		endpoint->slotsRefreshedAt = 0;
+		endpoint->parent = NULL;
+		endpoint->readNode = NULL;
+		endpoint->sentinelIndex = 0;
+		endpoint->sharedMaster = NULL;
+		endpoint->masterStale = false;
+		return endpoint;
+	}
+
+	/**
+	 * Puts each shard on the ring SHARD_RING_POINTS times, at the hashes of "host:port-i".
+	 * Only a shard's own points depend on it, so adding or removing one moves about 1/N
+	 * of the keys.
+	 */
+	void buildRedisHashRing(RedisEndpoint *shards)
+	{
+		shards->ring.clear();
+		for (map<string, RedisEndpoint *>::iterator it = shards->nodes.begin(); it != shards->nodes.end(); it++)
+		{
+			for (int i = 0; i < SHARD_RING_POINTS; i++)
+			{
+				char point[320];
+				int pointLength = snprintf(point, sizeof(point), "%s-%d", it->first.c_str(), i);
+				shards->ring[hashRedisRingKey(point, pointLength)] = it->second;
+			}
+		}
+	}
+
+	/**
+	 * Parses the comma separated host:port[:db] nodes of a cluster (its seeds, the rest
+	 * are learned from them), of a sharded target, or the replicas of a single endpoint
+	 */
+	bool parseRedisNodes(const char *nodes, int nodesLength, RedisEndpoint *parent)
+	{
+		int nodeCount;
+		sds *nodeParts = sdssplitlen(nodes, nodesLength, ",", 1, &nodeCount);
+
+		bool valid = nodeCount > 0;
+		for (int i = 0; i < nodeCount && valid; i++)
+		{
+			sds address = sdstrim(nodeParts[i], " \t");
+
+			RedisEndpoint *node = newRedisEndpoint(address);
+			node->parent = parent;
+
+			// Clusters only have database 0
+			valid = parseRedisAddress(address, sdslen(address), node) && (parent->topology != RedisTopology_Cluster || node->databaseIndex == 0);
+
+			// Named like the nodes CLUSTER SLOTS and redirects add, so a seed isn't added twice.
+			// A shard's name places it on the ring, so it doesn't change with its database.
+			if (valid)
+			{
+				char name[300];
+				snprintf(name, sizeof(name), "%s:%d", node->host.c_str(), node->port);
+				node->name = name;
+				valid = parent->nodes.count(node->name) == 0;
+			}
+
+			if (valid)
+			{
+				parent->nodes[node->name] = node;
+				if (parent->topology == RedisTopology_Sharded && parent->defaultNode == NULL)
+					parent->defaultNode = node;
+			}
+			else
+				delete node;
+		}
+
+		sdsfreesplitres(nodeParts, nodeCount);
+
+		parent->nodeList.assign(nodes, nodesLength);
+		if (parent->topology == RedisTopology_Cluster)
+		{
+			parent->host = parent->nodeList;
+			parent->slots.assign(CLUSTER_SLOTS, NULL);
+		}
+		else if (parent->topology == RedisTopology_Sharded)
+		{
+			parent->host = parent->nodeList;
+			buildRedisHashRing(parent);
+		}
+
+		return valid;
+	}
+
+	/**
+	 * Parses master[:db]@host:port,... : the name the sentinels know the primary by, the
+	 * database to select on it, and the sentinels to ask
+	 */
+	bool parseRedisSentinels(const char *address, int addressLength, RedisEndpoint *endpoint)
+	{
+		const char *at = (const char *)memchr(address, '@', addressLength);
+		if (at == NULL)
+			return false;
+
+		string master(address, at - address);
+		size_t colon = master.find(':');
+		if (colon != string::npos)
+		{
+			endpoint->databaseIndex = atoi(master.c_str() + colon + 1);
+			master.erase(colon);
+		}
+
+		master.erase(0, master.find_first_not_of(" \t"));
+		master.erase(master.find_last_not_of(" \t") + 1);
+		endpoint->sentinelMaster = master;
+		endpoint->sentinelList.assign(at + 1, address + addressLength);
+
+		int sentinelCount;
+		sds *sentinelParts = sdssplitlen(at + 1, address + addressLength - at - 1, ",", 1, &sentinelCount);
+
+		bool valid = master.size() > 0 && sentinelCount > 0;
+		for (int i = 0; i < sentinelCount && valid; i++)
+		{
+			sds sentinelAddress = sdstrim(sentinelParts[i], " \t");
+
+			RedisEndpoint *sentinel = newRedisEndpoint(sentinelAddress);
+			valid = parseRedisAddress(sentinelAddress, sdslen(sentinelAddress), sentinel) && sentinel->databaseIndex == 0;
+			if (valid)
+				endpoint->sentinels.push_back(make_pair(sentinel->host, sentinel->port));
+
+			delete sentinel;
+		}
+
+		sdsfreesplitres(sentinelParts, sentinelCount);
+		return valid;
+	}
+
+	/**
+	 * redis.dat is either a single host:port[:db] line, or one name=host:port[:db] line per
+	 * endpoint, plus optional name=value tunables. name.cluster=host:port,... declares a
+	 * cluster target by its seed nodes, name.shards=host:port[:db],... a sharded target by
+	 * its shards, name.sentinels=master[:db]@host:port,... an endpoint whose primary the
+	 * sentinels name, and name.replicas=host:port[:db],... the replicas of endpoint name.
+	 * Blank lines and lines starting with # are ignored.
+	 */
+	bool parseRedisConfig(const char *buffer, int bufferLength, map<string, RedisEndpoint *> &endpoints, RedisOptions &options)
+	{
+		int lineCount;
+		sds *lines = sdssplitlen(buffer, bufferLength, "\n", 1, &lineCount);
+
+		// Replicas belong to an endpoint that may only be declared further down
+		map<string, string> replicas;
+
+		bool valid = true;
+		for (int i = 0; i < lineCount && valid; i++)
+		{
+			sds line = sdstrim(lines[i], " \t\r");
+			if (sdslen(line) == 0 || line[0] == '#')
+				continue;
+
+			string name = DEFAULT_TARGET;
+			const char *address = line;
+			const char *equals = strchr(line, '=');
+			if (equals != NULL)
+			{
+				name = string(line, equals - line);
+				name.erase(name.find_last_not_of(" \t") + 1);
+				address = equals + 1;
+			}
+
+			if (parseRedisOption(name, address, options))
+				continue;
+
+			if (name.size() > 9 && name.compare(name.size() - 9, 9, ".replicas") == 0)
+			{
+				name.erase(name.size() - 9);
+				valid = replicas.count(name) == 0;
+				replicas[name] = address;
+				continue;
+			}
+
+			RedisTopology topology = RedisTopology_Single;
+			bool sentinels = false;
+			if (name.size() > 10 && name.compare(name.size() - 10, 10, ".sentinels") == 0)
+			{
+				name.erase(name.size() - 10);
+				sentinels = true;
+			}
+			else if (name.size() > 8 && name.compare(name.size() - 8, 8, ".cluster") == 0)
+			{
+				name.erase(name.size() - 8);
+				topology = RedisTopology_Cluster;
+			}
+			else if (name.size() > 7 && name.compare(name.size() - 7, 7, ".shards") == 0)
+			{
+				name.erase(name.size() - 7);
+				topology = RedisTopology_Sharded;
+			}
+
+			RedisEndpoint *endpoint = newRedisEndpoint(name);
+			endpoint->topology = topology;
+
+			bool parsed;
+			if (sentinels)
+				parsed = parseRedisSentinels(address, strlen(address), endpoint);
+			else if (topology != RedisTopology_Single)
+				parsed = parseRedisNodes(address, strlen(address), endpoint);
+			else
+				parsed = parseRedisAddress(address, strlen(address), endpoint);
+
+			if (endpoint->name.size() == 0 || endpoints.count(endpoint->name) != 0 || !parsed)
+			{
+				freeRedisEndpoint(endpoint);
+				valid = false;
+				break;
+			}
+
+			endpoints[endpoint->name] = endpoint;
+		}
+
+		sdsfreesplitres(lines, lineCount);
+
+		for (map<string, string>::iterator it = replicas.begin(); it != replicas.end() && valid; it++)
+		{
+			map<string, RedisEndpoint *>::iterator primary = endpoints.find(it->first);
+			valid = primary != endpoints.end() && primary->second->topology == RedisTopology_Single &&
+					parseRedisNodes(it->second.data(), it->second.size(), primary->second);
+		}
+
+		return valid && endpoints.size() > 0;
+	}
+
+	/**
+	 * Whether endpoints need a tracking connection. The shared cache relies on it too:
+	 * without one, nothing drops a shared entry when another client changes the key.
+	 */
+	bool isRedisTrackingWanted()
+	{
+		return _persistent->options.localCacheKeys > 0 || _persistent->options.sharedCacheSize > 0;
+	}
+
+	/**
+	 * Sets up the breaker and shared cache seed of an endpoint (and of a cluster's nodes),
+	 * and brings its connection in line with the options just loaded
+	 */
+	void prepareRedisEndpoint(RedisEndpoint *endpoint)
+	{
+		for (map<string, RedisEndpoint *>::iterator it = endpoint->nodes.begin(); it != endpoint->nodes.end(); it++)
+			prepareRedisEndpoint(it->second);
+
+		if (endpoint->topology != RedisTopology_Single)
+			return;
+
+		// A sentinel endpoint gets the breaker of each primary it's moved to
+		if (endpoint->sentinelMaster.size() > 0 && endpoint->sharedMaster == NULL)
+			endpoint->sharedMaster = findRedisSharedMaster(endpoint);
+		else if (endpoint->sentinelMaster.size() == 0 && endpoint->breaker == NULL)
+			endpoint->breaker = findRedisBreaker(endpoint->host, endpoint->port);
+
+		// The data stays the same when a sentinel endpoint fails over, so the seed must too
+		if (endpoint->cacheSeed == 0)
+		{
+			string identity = endpoint->sentinelMaster.size() > 0 ? endpoint->sentinelMaster + "@" + endpoint->sentinelList : endpoint->host;
+			char seed[1024];
+			int seedLength = snprintf(seed, sizeof(seed), "%s:%d:%d", identity.c_str(), endpoint->port, endpoint->databaseIndex);
+			endpoint->cacheSeed = hashSharedCacheKey(14695981039346656037ull, seed, seedLength);
+		}
+
+		if (endpoint->context != NULL)
+			setRedisCommandTimeout(endpoint->context);
+
+		// Reconnect so tracking is turned on or off to match the cache options
+		if (endpoint->context != NULL && (endpoint->trackingContext != NULL) != isRedisTrackingWanted())
+			freeRedisConnection(endpoint);
+	}
+
+	bool loadRedisConfig(mvProgram program, mvVariable returnValue)
+	{
+		// Only re-read redis.dat when it has changed since the last time this process parsed it
+		int configTime = mvFile_Time(program, MVF_DATA, "redis.dat", 9);
+		if (_persistent->configTime != 0 && _persistent->configTime == configTime)
+			return true;
+
+		mvFile redisConfigFile = mvFile_Open(program, MVF_DATA, "redis.dat", 9, MVF_MODE_READ);
+
+		if (redisConfigFile == 0)
+		{
+			// file not found
+			setRedisError(ERROR_REDIS_CONFIG_NOT_FOUND, "redis.dat config file not found!", program, returnValue);
+			return false;
+		}
+
+		long fileLength = mvFile_Length(redisConfigFile);
+		char *buffer = new char[fileLength];
+		mvFile_Read(redisConfigFile, buffer, fileLength);
+		mvFile_Close(redisConfigFile);
+
+		RedisPersistentState parsed;
+		setDefaultRedisOptions(parsed.options);
+		bool valid = parseRedisConfig(buffer, fileLength, parsed.endpoints, parsed.options);
+		delete[] buffer;
+
+		if (!valid)
+		{
+			freeRedisEndpoints(&parsed);
+			setRedisError(ERROR_REDIS_CONFIG_INVALID, "Invalid redis.dat config file!", program, returnValue);
+			return false;
+		}
+
+		// Keep the connections of endpoints that still point at the same server
+		for (map<string, RedisEndpoint *>::iterator it = parsed.endpoints.begin(); it != parsed.endpoints.end(); it++)
+		{
+			map<string, RedisEndpoint *>::iterator existing = _persistent->endpoints.find(it->first);
+			if (existing == _persistent->endpoints.end())
+				continue;
+
+			RedisEndpoint *endpoint = existing->second;
+			// A sentinel endpoint's host is whatever the sentinels named, not something redis.dat set
+			bool sameServer = endpoint->sentinelMaster.size() > 0 || (endpoint->host == it->second->host && endpoint->port == it->second->port);
+			if (endpoint->topology == it->second->topology && sameServer && endpoint->databaseIndex == it->second->databaseIndex && endpoint->nodeList == it->second->nodeList &&
+				endpoint->sentinelMaster == it->second->sentinelMaster && endpoint->sentinelList == it->second->sentinelList)
+			{
+				freeRedisEndpoint(it->second);
+				it->second = endpoint;
+				_persistent->endpoints.erase(existing);
+			}
+		}
+
+		freeRedisEndpoints(_persistent);
+		_persistent->endpoints.swap(parsed.endpoints);
+		_persistent->options = parsed.options;
+		_persistent->configTime = configTime;
+		mapSharedCache(program, _persistent);
+
+		for (map<string, RedisEndpoint *>::iterator it = _persistent->endpoints.begin(); it != _persistent->endpoints.end(); it++)
+			prepareRedisEndpoint(it->second);
+
+		_target = NULL;
+		_endpoint = NULL;
+		_connection = NULL;
+		return true;
+	}
+
+	uint64_t checksumSharedCacheRecord(const char *data, size_t length)
+	{
+		uint64_t checksum = length;
+		size_t i = 0;
+		for (; i + 8 <= length; i += 8)
+		{
+			uint64_t word;
+			memcpy(&word, data + i, sizeof(word));
+			checksum = (checksum ^ word) * 0x9e3779b97f4a7c15ull;
+			checksum ^= checksum >> 32;
+		}
+
+		for (; i < length; i++)
+			checksum = (checksum ^ (unsigned char)data[i]) * 0x9e3779b97f4a7c15ull;
+
+		return checksum;
+	}
+
+	RedisSharedCacheSlot *getSharedCacheSlots(RedisSharedCache *cache)
+	{
+		return (RedisSharedCacheSlot *)(cache + 1);
+	}
+
+	char *getSharedCacheArena(RedisSharedCache *cache)
+	{
+		return (char *)(getSharedCacheSlots(cache) + cache->slotCount);
+	}
+
+	/**
+	 * Returns a malloc'd, NUL terminated copy of a key's value from the shared cache, or
+	 * NULL if it isn't there. Entries dated further ahead than shared_cache_ttl count as
+	 * expired, so a clock stepping backwards can't keep them alive. An endpoint without
+	 * tracking never sees invalidations, so it leaves the shared cache alone.
+	 */
+	char *findSharedCacheEntry(RedisEndpoint *endpoint, const char *key, int keyLength, size_t *valueLength)
+	{
+		RedisSharedCache *cache = _persistent->sharedCache;
+		if (cache == NULL || endpoint->trackingContext == NULL)
+			return NULL;
+
+		uint64_t hash = hashSharedCacheKey(endpoint->cacheSeed, key, keyLength);
+		RedisSharedCacheSlot *slots = getSharedCacheSlots(cache);
+		char *arena = getSharedCacheArena(cache);
+		int64_t now = wallTimeMillis();
+
+		for (int probe = 0; probe < SHARED_CACHE_PROBES; probe++)
+		{
+			RedisSharedCacheSlot *slot = &slots[(hash + probe) % cache->slotCount];
+
+			uint32_t sequence = *(volatile uint32_t *)&slot->sequence;
+			__sync_synchronize();
+
+			RedisSharedCacheSlot entry = *slot;
+			__sync_synchronize();
+
+			if ((sequence & 1) || *(volatile uint32_t *)&slot->sequence != sequence)
+				continue;
+
+			if (entry.hash != hash || entry.generation != *(volatile uint32_t *)&cache->generation || entry.keyLength != (uint32_t)keyLength)
+				continue;
+
+			if (entry.expiresAt <= now || entry.expiresAt - now > _persistent->options.sharedCacheTtl)
+				return NULL;
+
+			uint64_t offset = entry.position % cache->arenaSize;
+			if (offset + entry.keyLength + entry.valueLength > cache->arenaSize || memcmp(arena + offset, key, keyLength) != 0)
+				continue;
+
+			char *value = (char *)malloc(entry.valueLength + 1);
+			if (value == NULL)
+				return NULL;
+
+			memcpy(value, arena + offset + entry.keyLength, entry.valueLength);
+			__sync_synchronize();
+
+			// A writer reserved the bytes we copied while we were reading them, or wrote over them late
+			if (*(volatile uint64_t *)&cache->arenaHead > entry.position + cache->arenaSize || checksumSharedCacheRecord(value, entry.valueLength) != entry.checksum)
+			{
+				free(value);
+				return NULL;
+			}
+
+			value[entry.valueLength] = '\0';
+			*valueLength = entry.valueLength;
+			return value;
+		}
+
+		return NULL;
+	}
+
+	/**
+	 * Locks a slot for writing, returning its unlocked sequence. A writer that dies while
+	 * holding a slot only costs that slot.
+	 */
+	bool lockSharedCacheSlot(RedisSharedCacheSlot *slot, uint32_t *sequence, int attempts)
+	{
+		for (int i = 0; i < attempts; i++)
+		{
+			*sequence = *(volatile uint32_t *)&slot->sequence;
+			if ((*sequence & 1) == 0 && __sync_bool_compare_and_swap(&slot->sequence, *sequence, *sequence + 1))
+				return true;
+
+			sched_yield();
+		}
+
+		return false;
+	}
+
+	void unlockSharedCacheSlot(RedisSharedCacheSlot *slot, uint32_t sequence)
+	{
+		__sync_synchronize();
+		*(volatile uint32_t *)&slot->sequence = sequence + 2;
+	}
+
+	bool isSharedCacheSlotFree(RedisSharedCacheSlot *slot, uint32_t generation, int64_t now)
+	{
+		return slot->hash == 0 || slot->generation != generation || slot->expiresAt <= now;
+	}
+
+	/**
+	 * Copies a value just read from redis into the shared cache. The slot is the key's own,
+	 * else a free or expired one, else the one closest to expiring among its probes.
+	 * Values over an eighth of the arena aren't cached.
+	 */
+	void storeSharedCacheEntry(RedisEndpoint *endpoint, const char *key, int keyLength, const char *value, size_t valueLength)
+	{
+		RedisSharedCache *cache = _persistent->sharedCache;
+		if (cache == NULL || endpoint->trackingContext == NULL || keyLength + valueLength > cache->arenaSize / 8)
+			return;
+
+		uint64_t hash = hashSharedCacheKey(endpoint->cacheSeed, key, keyLength);
+		RedisSharedCacheSlot *slots = getSharedCacheSlots(cache);
+		uint32_t generation = *(volatile uint32_t *)&cache->generation;
+		int64_t now = wallTimeMillis();
+
+		RedisSharedCacheSlot *slot = NULL;
+		for (int probe = 0; probe < SHARED_CACHE_PROBES; probe++)
+		{
+			RedisSharedCacheSlot *candidate = &slots[(hash + probe) % cache->slotCount];
+			if (candidate->hash == hash)
+			{
+				slot = candidate;
+				break;
+			}
+
+			if (slot == NULL || isSharedCacheSlotFree(slot, generation, now))
+			{
+				if (slot == NULL)
+					slot = candidate;
+
+				continue;
+			}
+
+			if (isSharedCacheSlotFree(candidate, generation, now) || candidate->expiresAt < slot->expiresAt)
+				slot = candidate;
+		}
+
+		uint32_t sequence;
+		if (!lockSharedCacheSlot(slot, &sequence, 1))
+			return;
+
+		// Records never straddle the end of the arena
+		uint64_t recordLength = keyLength + valueLength;
+		uint64_t head, position;
+		do
+		{
+			head = *(volatile uint64_t *)&cache->arenaHead;
+			position = head;
+
+			uint64_t offset = position % cache->arenaSize;
+			if (offset + recordLength > cache->arenaSize)
+				position += cache->arenaSize - offset;
+		} while (!__sync_bool_compare_and_swap(&cache->arenaHead, head, position + recordLength));
+
+		char *record = getSharedCacheArena(cache) + position % cache->arenaSize;
+		memcpy(record, key, keyLength);
+		memcpy(record + keyLength, value, valueLength);
+		__sync_synchronize();
+
+		slot->hash = hash;
+		slot->generation = generation;
+		slot->position = position;
+		slot->keyLength = keyLength;
+		slot->valueLength = valueLength;
+		slot->expiresAt = now + _persistent->options.sharedCacheTtl;
+		slot->checksum = checksumSharedCacheRecord(value, valueLength);
+		unlockSharedCacheSlot(slot, sequence);
+	}
+
+	void forgetSharedCacheEntry(RedisEndpoint *endpoint, const char *key, int keyLength)
+	{
+		RedisSharedCache *cache = _persistent->sharedCache;
+		if (cache == NULL)
+			return;
+
+		uint64_t hash = hashSharedCacheKey(endpoint->cacheSeed, key, keyLength);
+		RedisSharedCacheSlot *slots = getSharedCacheSlots(cache);
+
+		for (int probe = 0; probe < SHARED_CACHE_PROBES; probe++)
+		{
+			RedisSharedCacheSlot *slot = &slots[(hash + probe) % cache->slotCount];
+			if (*(volatile uint64_t *)&slot->hash != hash)
+				continue;
+
+			// Wait out a writer rather than leave a stale value behind
+			uint32_t sequence;
+			if (lockSharedCacheSlot(slot, &sequence, 100))
+			{
+				if (slot->hash == hash)
+					slot->hash = 0;
+
+				unlockSharedCacheSlot(slot, sequence);
+			}
+		}
+	}
+
+	/**
+	 * Opens the connection that receives invalidations for the local and shared caches:
+	 * it subscribes to __redis__:invalidate, then the main connection turns on CLIENT
+	 * TRACKING with REDIRECT to it. This works over RESP2, so it doesn't need RESP3 push
+	 * support. On failure (e.g. redis < 6) the endpoint just runs without either cache.
+	 */
+	void connectRedisTracking(RedisEndpoint *endpoint, redisContext *context)
+	{
+		redisContext *trackingContext = redisConnectWithTimeout(endpoint->host.c_str(), endpoint->port, millisToTimeval(_persistent->options.connectTimeout));
+		if (trackingContext == NULL)
+			return;
+
+		setRedisCommandTimeout(trackingContext);
+
+		bool tracking = false;
+		redisReply *reply = trackingContext->err ? NULL : (redisReply *)redisCommand(trackingContext, "CLIENT ID");
+		if (reply != NULL && reply->type == REDIS_REPLY_INTEGER)
+		{
+			long long clientId = reply->integer;
+			freeReplyObject(reply);
+
+			reply = (redisReply *)redisCommand(trackingContext, "SUBSCRIBE %s", TRACKING_CHANNEL);
+			if (reply != NULL && reply->type == REDIS_REPLY_ARRAY)
+			{
+				freeReplyObject(reply);
+
+				reply = (redisReply *)redisCommand(context, "CLIENT TRACKING on REDIRECT %lld", clientId);
+				tracking = reply != NULL && reply->type == REDIS_REPLY_STATUS;
+			}
+		}
+
+		if (reply != NULL)
+			freeReplyObject(reply);
+
+		if (!tracking)
+		{
+			redisFree(trackingContext);
+			return;
+		}
+
+		endpoint->trackingContext = trackingContext;
+	}
+
+	/**
+	 * Drops a key from the local cache, either because redis invalidated it or because it
+	 * was just written through this connection. Redis sends an invalidation for those too,
+	 * dropping the key here makes the write visible to the rest of the request at once.
+	 */
+	void forgetRedisCacheEntry(RedisEndpoint *endpoint, const char *key, int keyLength)
+	{
+		// A key written to a primary may have been cached from any of its replicas
+		if (endpoint->topology == RedisTopology_Single)
+		{
+			for (map<string, RedisEndpoint *>::iterator it = endpoint->nodes.begin(); it != endpoint->nodes.end(); it++)
+				forgetRedisCacheEntry(it->second, key, keyLength);
+		}
+
+		forgetSharedCacheEntry(endpoint, key, keyLength);
+
+		if (endpoint->cache.empty())
+			return;
+
+		map<string, RedisCacheEntry>::iterator it = endpoint->cache.find(string(key, keyLength));
+		if (it != endpoint->cache.end())
+		{
+			endpoint->cacheOrder.erase(it->second.order);
+			endpoint->cache.erase(it);
+		}
+	}
+
+	/**
+	 * Applies the invalidations waiting on the tracking connection without blocking. A
+	 * nil key list means the server was flushed. If the tracking connection fails the
+	 * cache is dropped, until the next reconnect sets it up again.
+	 */
+	void readRedisInvalidations(RedisEndpoint *endpoint)
+	{
+		redisContext *context = endpoint->trackingContext;
+		while (true)
+		{
+			redisReply *reply = NULL;
+			if (redisGetReplyFromReader(context, (void **)&reply) != REDIS_OK)
+				break;
+
+			if (reply == NULL)
+			{
+				pollfd readable = {context->fd, POLLIN, 0};
+				if (poll(&readable, 1, 0) <= 0)
+					return;
+
+				if (redisBufferRead(context) != REDIS_OK)
+					break;
+
+				continue;
+			}
+
+			if (reply->type == REDIS_REPLY_ARRAY && reply->elements == 3)
+			{
+				redisReply *keys = reply->element[2];
+				if (keys->type == REDIS_REPLY_ARRAY)
+				{
+					for (size_t i = 0; i < keys->elements; i++)
+						forgetRedisCacheEntry(endpoint, keys->element[i]->str, keys->element[i]->len);
+				}
+				else
+				{
+					endpoint->cache.clear();
+					endpoint->cacheOrder.clear();
+
+					if (_persistent->sharedCache != NULL)
+						__sync_fetch_and_add(&_persistent->sharedCache->generation, 1);
+				}
+			}
+
+			freeReplyObject(reply);
+		}
+
+		clearRedisCache(endpoint);
+	}
+
+	/**
+	 * Returns the locally cached value of a key, or NULL if it isn't cached (or the cache
+	 * is off)
+	 */
+	const string *findRedisCacheEntry(RedisEndpoint *endpoint, const char *key, int keyLength)
+	{
+		if (endpoint->trackingContext == NULL)
+			return NULL;
+
+		readRedisInvalidations(endpoint);
+
+		map<string, RedisCacheEntry>::iterator it = endpoint->cache.find(string(key, keyLength));
+		if (it == endpoint->cache.end())
+			return NULL;
+
+		RedisCacheEntry &entry = it->second;
+		if (entry.expiresAt != 0 && entry.expiresAt <= currentTimeMillis())
+		{
+			endpoint->cacheOrder.erase(entry.order);
+			endpoint->cache.erase(it);
+			return NULL;
+		}
+
+		endpoint->cacheOrder.splice(endpoint->cacheOrder.begin(), endpoint->cacheOrder, entry.order);
+		return &entry.value;
+	}
+
+	/**
+	 * Caches a value just read from redis, evicting the least recently used keys beyond
+	 * local_cache_keys
+	 */
+	void storeRedisCacheEntry(RedisEndpoint *endpoint, const char *key, int keyLength, const char *value, int valueLength)
+	{
+		if (endpoint->trackingContext == NULL || _persistent->options.localCacheKeys <= 0)
+			return;
+
+		string cacheKey(key, keyLength);
+		map<string, RedisCacheEntry>::iterator it = endpoint->cache.find(cacheKey);
+		if (it == endpoint->cache.end())
+		{
+			it = endpoint->cache.insert(std::make_pair(cacheKey, RedisCacheEntry())).first;
+			endpoint->cacheOrder.push_front(cacheKey);
+			it->second.order = endpoint->cacheOrder.begin();
+		}
+		else
+		{
+			endpoint->cacheOrder.splice(endpoint->cacheOrder.begin(), endpoint->cacheOrder, it->second.order);
+		}
+
+		RedisCacheEntry &entry = it->second;
+		entry.value.assign(value, valueLength);
+		entry.expiresAt = _persistent->options.localCacheTtl > 0 ? currentTimeMillis() + _persistent->options.localCacheTtl : 0;
+
+		while (endpoint->cache.size() > (size_t)_persistent->options.localCacheKeys)
+		{
+			endpoint->cache.erase(endpoint->cacheOrder.back());
+			endpoint->cacheOrder.pop_back();
+		}
+	}
+
+	bool connectRedis(mvProgram program, mvVariable returnValue, RedisEndpoint *endpoint)
+	{
+		freeRedisConnection(endpoint);
+
+		if (!allowRedisAttempt(endpoint->breaker))
+		{
+			setRedisError(ERROR_CIRCUIT_OPEN, "Circuit open for redis " + endpoint->host + ", not connecting!", program, returnValue);
+			return false;
+		}
+
+		redisContext *context = redisConnectWithTimeout(endpoint->host.c_str(), endpoint->port, millisToTimeval(_persistent->options.connectTimeout));
+		if (context == NULL)
+		{
+			setRedisError(ERROR_CONNECT_ERROR, "Could not allocate redis context!", program, returnValue);
+			return false;
+		}
+
+		if (context->err)
+		{
+			setRedisError(ERROR_CONNECT_ERROR, context->errstr, program, returnValue);
+			redisFree(context);
+			recordRedisFailure(endpoint->breaker);
+			return false;
+		}
+
+		setRedisCommandTimeout(context);
+
+		if (endpoint->databaseIndex != 0)
+		{
+			redisReply *reply = (redisReply *)redisCommand(context, "SELECT %d", endpoint->databaseIndex);
+			if (reply == NULL || reply->type == REDIS_REPLY_ERROR)
+			{
+				setRedisError(ERROR_CONNECT_ERROR, reply == NULL ? context->errstr : reply->str, program, returnValue);
+				if (reply != NULL)
+					freeReplyObject(reply);
+				else
+					recordRedisFailure(endpoint->breaker);
+
+				redisFree(context);
+				return false;
+			}
+
+			freeReplyObject(reply);
+		}
+
+		if (isRedisTrackingWanted())
+			connectRedisTracking(endpoint, context);
+
+		recordRedisSuccess(endpoint->breaker);
+		endpoint->context = context;
+		return true;
+	}
+
+	/**
+	 * Called when a command fails with an I/O error (timeout, reset, EOF). The connection
+	 * is unusable after that, so drop it and count the failure against the breaker. The
+	 * next call reconnects, or fails without touching the network once the circuit opens.
+	 */
+	void failRedisEndpoint(RedisEndpoint *endpoint)
+	{
+		recordRedisError(ERROR_COMMAND, endpoint->context->errstr);
+		recordRedisFailure(endpoint->breaker);
+		freeRedisConnection(endpoint);
+
+		// The primary may have failed over, a sentinel endpoint asks again before reconnecting
+		endpoint->masterStale = true;
+	}
+
+	/**
+	 * Whether a reply says the server was demoted to a replica, e.g. by a failover
+	 */
+	bool isRedisReadOnlyError(redisReply *reply)
+	{
+		return reply->type == REDIS_REPLY_ERROR && reply->len >= 8 && strncmp(reply->str, "READONLY", 8) == 0;
+	}
+
+	void setRedisConnectionError(mvProgram program, mvVariable returnValue)
+	{
+		failRedisEndpoint(_endpoint);
+		mvVariable_SetValue_Integer(returnValue, 0);
+	}
+
+	bool followRedisRedirects(RedisEndpoint *cluster, redisReply **reply, RedisEndpoint **node, const char *command, size_t commandLength);
+
+	/**
+	 * Keeps a reply read ahead for redis_get_reply. Replies to redis_command_nowait are
+	 * discarded, errors among them are still recorded.
+	 */
+	void queueRedisReply(RedisEndpoint *endpoint, redisReply *reply)
+	{
+		RedisPendingReply pending;
+		pending.wanted = endpoint->pendingReplies.front().wanted;
+		pending.stream = endpoint->pendingReplies.front().stream;
+		pending.command.swap(endpoint->pendingReplies.front().command);
+		endpoint->pendingReplies.pop_front();
+
+		if (isRedisReadOnlyError(reply))
+			endpoint->masterStale = true;
+
+		// Sent to the wrong cluster node, resend it to the one redis names
+		RedisEndpoint *node = endpoint;
+		if (reply->type == REDIS_REPLY_ERROR && pending.command.size() > 0 &&
+			!followRedisRedirects(endpoint->parent, &reply, &node, pending.command.data(), pending.command.size()))
+			reply = NULL;
+
+		if (pending.wanted)
+		{
+			endpoint->wantedReplies--;
+
+			if (reply != NULL)
+			{
+				endpoint->replies.push_back(reply);
+				return;
+			}
+
+			// Lost to a redirect that couldn't be followed
+			endpoint->droppedReplies++;
+
+			// redis_get_reply matches the replies of a target's nodes by position, keep a gap
+			if (endpoint->parent != NULL || !endpoint->nodes.empty())
+				endpoint->replies.push_back(NULL);
+		}
+
+		if (reply == NULL)
+			return;
+
+		if (reply->type == REDIS_REPLY_ERROR)
+		{
+			recordRedisError(ERROR_COMMAND, reply->str);
+
+			// A lost chunk keeps redis_append_stream_end from renaming the partial value
+			if (pending.stream != 0 && pending.stream == _appendStream.id)
+				_appendStream.failed = true;
+		}
+
+		freeReplyObject(reply);
+	}
+
+	/**
+	 * Whether pipeline_max_replies replies are waiting for redis_get_reply, so reading
+	 * ahead has to stop
+	 */
+	bool isRedisReplyQueueFull(RedisEndpoint *endpoint)
+	{
+		int maxReplies = _persistent->options.pipelineMaxReplies;
+		return maxReplies > 0 && endpoint->replies.size() >= (size_t)maxReplies;
+	}
+
+	/**
+	 * Moves replies to appended commands off the socket into the endpoint's reply queue.
+	 * With wait, blocks until every pending reply has arrived (a command is about to be
+	 * sent that needs its own). Otherwise only reads what is already available, and
+	 * leaves it on the socket once the queue is full.
+	 */
+	bool drainRedisReplies(RedisEndpoint *endpoint, bool wait)
+	{
+		redisContext *context = endpoint->context;
+		while (!endpoint->pendingReplies.empty())
+		{
+			if (!wait && isRedisReplyQueueFull(endpoint))
+				return true;
+
+			redisReply *reply = NULL;
+			if (redisGetReplyFromReader(context, (void **)&reply) != REDIS_OK)
+				return false;
+
+			if (reply == NULL && wait)
+			{
+				// Writes anything still buffered, then blocks for the reply
+				if (redisGetReply(context, (void **)&reply) != REDIS_OK)
+					return false;
+			}
+			else if (reply == NULL)
+			{
+				pollfd readable = {context->fd, POLLIN, 0};
+				if (poll(&readable, 1, 0) <= 0)
+					return true;
+
+				if (redisBufferRead(context) != REDIS_OK)
+					return false;
+
+				continue;
+			}
+
+			queueRedisReply(endpoint, reply);
+		}
+
+		return true;
+	}
+
+	/**
+	 * Writes the appended commands to the socket, reading replies as they arrive so
+	 * neither side's buffers grow with the size of the pipeline
+	 */
+	bool flushRedisPipeline(RedisEndpoint *endpoint)
+	{
+		int done = 0;
+		while (!done)
+		{
+			if (redisBufferWrite(endpoint->context, &done) != REDIS_OK)
+				return false;
+
+			if (!drainRedisReplies(endpoint, false))
+				return false;
+		}
+
+		endpoint->unflushedCommands = 0;
+		return true;
+	}
+
+	/**
+	 * Writes as much of the appended commands as the socket takes without blocking, so
+	 * nowait commands reach the server during the request. Whatever doesn't fit stays
+	 * buffered for the next flush, and replies are left for the next drain.
+	 */
+	bool sendRedisPipeline(RedisEndpoint *endpoint)
+	{
+		redisContext *context = endpoint->context;
+		while (sdslen(context->obuf) > 0)
+		{
+			ssize_t count = send(context->fd, context->obuf, sdslen(context->obuf), MSG_DONTWAIT | MSG_NOSIGNAL);
+			if (count < 0)
+			{
+				if (errno == EINTR)
+					continue;
+
+				if (errno == EAGAIN || errno == EWOULDBLOCK)
+					return true;
+
+				context->err = REDIS_ERR_IO;
+				snprintf(context->errstr, sizeof(context->errstr), "%s", strerror(errno));
+				return false;
+			}
+
+			sdsrange(context->obuf, count, -1);
+		}
+
+		endpoint->unflushedCommands = 0;
+		return true;
+	}
+
+	/**
+	 * Blocks until every pending reply has arrived, or until the queue is full. Those
+	 * beyond it are left for redis_get_reply to read.
+	 */
+	bool awaitRedisReplies(RedisEndpoint *endpoint)
+	{
+		while (!endpoint->pendingReplies.empty() && !isRedisReplyQueueFull(endpoint))
+		{
+			redisReply *reply;
+			if (redisGetReply(endpoint->context, (void **)&reply) != REDIS_OK)
+				return false;
+
+			queueRedisReply(endpoint, reply);
+		}
+
+		return true;
+	}
+
+	/**
+	 * Discards the replies an earlier request appended but never read, so they can't be
+	 * taken for this one's. Drops the connection if they can't be read off it.
+	 */
+	void discardRedisReplies(RedisEndpoint *endpoint)
+	{
+		for (size_t i = 0; i < endpoint->replies.size(); i++)
+			freeReplyObject(endpoint->replies[i]);
+
+		endpoint->replies.clear();
+		endpoint->droppedReplies = 0;
+
+		redisContext *context = endpoint->context;
+		for (; context != NULL && !endpoint->pendingReplies.empty(); endpoint->pendingReplies.pop_front())
+		{
+			redisReply *reply;
+			if (redisGetReply(context, (void **)&reply) != REDIS_OK)
+			{
+				freeRedisConnection(endpoint);
+				break;
+			}
+
+			if (reply)
+				freeReplyObject(reply);
+		}
+
+		endpoint->wantedReplies = 0;
+	}
+
+	/**
+	 * Makes sure a connection is still usable: one that has been idle for a while (say,
+	 * since a previous request) is PINGed. Returns false if it must be rebuilt.
+	 */
+	bool checkRedisConnection(RedisEndpoint *endpoint)
+	{
+		redisContext *context = endpoint->context;
+		if (context == NULL || context->err)
+			return false;
+
+		// A PING can't be slipped in ahead of replies still on the wire
+		if (time(NULL) - endpoint->lastUsed < IDLE_PING_SECONDS || !endpoint->pendingReplies.empty())
+			return true;
+
+		redisReply *reply = (redisReply *)redisCommand(context, "PING");
+		if (reply == NULL)
+			return false;
+
+		bool ok = reply->type != REDIS_REPLY_ERROR;
+		freeReplyObject(reply);
+		return ok;
+	}
+
+	/**
+	 * Asks one sentinel for the address of master's primary, on a connection of its own
+	 * that is closed again right away
+	 */
+	bool askRedisSentinel(const pair<string, int> &sentinel, const string &master, string &host, int &port)
+	{
+		timeval timeout = millisToTimeval(_persistent->options.connectTimeout);
+		redisContext *context = redisConnectWithTimeout(sentinel.first.c_str(), sentinel.second, timeout);
+		if (context == NULL)
+			return false;
+
+		bool found = false;
+		if (!context->err)
+		{
+			redisSetTimeout(context, timeout);
+
+			redisReply *reply = (redisReply *)redisCommand(context, "SENTINEL get-master-addr-by-name %s", master.c_str());
+			if (reply != NULL && reply->type == REDIS_REPLY_ARRAY && reply->elements == 2 && reply->element[0]->type == REDIS_REPLY_STRING &&
+				reply->element[1]->type == REDIS_REPLY_STRING)
+			{
+				host.assign(reply->element[0]->str, reply->element[0]->len);
+				port = atoi(reply->element[1]->str);
+				found = host.size() > 0 && port > 0;
+			}
+
+			if (reply != NULL)
+				freeReplyObject(reply);
+		}
+
+		redisFree(context);
+		return found;
+	}
+
+	/**
+	 * Points a sentinel endpoint at host:port, dropping the connection to the old primary
+	 */
+	void moveRedisMaster(RedisEndpoint *endpoint, const string &host, int port)
+	{
+		if (endpoint->host == host && endpoint->port == port)
+			return;
+
+		freeRedisConnection(endpoint);
+		endpoint->host = host;
+		endpoint->port = port;
+		endpoint->breaker = findRedisBreaker(host, port);
+	}
+
+	/**
+	 * Finds a sentinel endpoint's primary. An answer another process got from the sentinels
+	 * less than SENTINEL_REFRESH_MILLIS ago is used as is, otherwise they are asked in
+	 * turn, starting with the one that answered last. Once the primary has replied
+	 * READONLY (demoted), a fresh answer naming it is stale too, only one naming another
+	 * server is used.
+	 */
+	bool resolveRedisMaster(mvProgram program, mvVariable returnValue, RedisEndpoint *endpoint, bool demoted)
+	{
+		string host;
+		int port;
+		int64_t resolvedAt;
+		bool fresh = readSharedRedisMaster(endpoint, host, port, resolvedAt) && wallTimeMillis() - resolvedAt < SENTINEL_REFRESH_MILLIS &&
+					 (!demoted || host != endpoint->host || port != endpoint->port);
+		if (!fresh)
+		{
+			bool found = false;
+			for (size_t i = 0; i < endpoint->sentinels.size() && !found; i++)
+			{
+				size_t index = (endpoint->sentinelIndex + i) % endpoint->sentinels.size();
+				found = askRedisSentinel(endpoint->sentinels[index], endpoint->sentinelMaster, host, port);
+				if (found)
+					endpoint->sentinelIndex = index;
+			}
+
+			if (!found)
+			{
+				setRedisError(ERROR_CONNECT_ERROR, "No sentinel knows the primary of " + endpoint->sentinelMaster + "!", program, returnValue);
+				return false;
+			}
+
+			writeSharedRedisMaster(endpoint, host, port);
+		}
+
+		moveRedisMaster(endpoint, host, port);
+		endpoint->masterStale = false;
+		return true;
+	}
+
+	/**
+	 * Verifies (or makes) the connection of a sentinel endpoint. It follows a primary
+	 * another process has found first, and asks for it again when its own has failed.
+	 */
+	bool connectRedisMaster(mvProgram program, mvVariable returnValue, RedisEndpoint *endpoint)
+	{
+		string host;
+		int port;
+		int64_t resolvedAt;
+		if (readSharedRedisMaster(endpoint, host, port, resolvedAt))
+			moveRedisMaster(endpoint, host, port);
+
+		if (!endpoint->masterStale && endpoint->host.size() > 0 && (checkRedisConnection(endpoint) || connectRedis(program, returnValue, endpoint)))
+			return true;
+
+		return resolveRedisMaster(program, returnValue, endpoint, false) && (checkRedisConnection(endpoint) || connectRedis(program, returnValue, endpoint));
+	}
+
+	/**
+	 * Makes endpoint the one the following commands go to. A connection that is missing,
+	 * broken or idle is checked (or made) again; a server that keeps failing is kept off
+	 * the network by its breaker.
+	 */
+	bool useRedisEndpoint(mvProgram program, mvVariable returnValue, RedisEndpoint *endpoint)
+	{
+		_endpoint = endpoint;
+		if (endpoint->checkedRequest != _persistent->requestCount)
+		{
+			endpoint->checkedRequest = _persistent->requestCount;
+			discardRedisReplies(endpoint);
+
+			// A primary picks a replica for each request
+			endpoint->readNode = NULL;
+			endpoint->replyOrder.clear();
+		}
+
+		bool ready;
+		if (endpoint->sentinelMaster.size() > 0)
+			ready = connectRedisMaster(program, returnValue, endpoint);
+		else
+			ready = checkRedisConnection(endpoint) || connectRedis(program, returnValue, endpoint);
+
+		_connection = endpoint->context;
+		if (ready)
+			endpoint->lastUsed = time(NULL);
+
+		return ready;
+	}
+
+	bool isRedisCommand(const char *command, size_t commandLength, const char *name)
+	{
+		return commandLength == strlen(name) && strncasecmp(command, name, commandLength) == 0;
+	}
+
+	/**
+	 * Finds the key a command works on, to route it by. Most commands take it first,
+	 * the exceptions are listed with where theirs is: -1 after EVAL's numkeys, -2 after
+	 * XREAD's STREAMS, and 0 for commands without a key.
+	 */
+	const char *findRedisCommandKey(int argc, const char **argv, const size_t *argvlen, size_t *keyLength)
+	{
+		static const struct
+		{
+			const char *name;
+			int keyIndex;
+		} exceptions[] = {
+			{"BITOP", 2}, {"EVAL", -1}, {"EVALSHA", -1}, {"EVAL_RO", -1}, {"EVALSHA_RO", -1}, {"FCALL", -1}, {"FCALL_RO", -1},
+			{"MEMORY", 2}, {"OBJECT", 2}, {"XGROUP", 2}, {"XINFO", 2}, {"XREAD", -2}, {"XREADGROUP", -2},
+			{"ACL", 0}, {"AUTH", 0}, {"BGREWRITEAOF", 0}, {"BGSAVE", 0}, {"CLIENT", 0}, {"CLUSTER", 0}, {"COMMAND", 0},
+			{"CONFIG", 0}, {"DBSIZE", 0}, {"DEBUG", 0}, {"DISCARD", 0}, {"ECHO", 0}, {"EXEC", 0}, {"FLUSHALL", 0},
+			{"FLUSHDB", 0}, {"FUNCTION", 0}, {"HELLO", 0}, {"INFO", 0}, {"KEYS", 0}, {"LASTSAVE", 0}, {"LATENCY", 0},
+			{"MODULE", 0}, {"MULTI", 0}, {"PING", 0}, {"PUBLISH", 0}, {"PUBSUB", 0}, {"RANDOMKEY", 0}, {"ROLE", 0},
+			{"SAVE", 0}, {"SCAN", 0}, {"SCRIPT", 0}, {"SELECT", 0}, {"SLOWLOG", 0}, {"TIME", 0}, {"UNWATCH", 0}, {"WAIT", 0}};
+
+		int keyIndex = 1;
+		for (size_t i = 0; i < sizeof(exceptions) / sizeof(exceptions[0]); i++)
+		{
+			if (isRedisCommand(argv[0], argvlen[0], exceptions[i].name))
+			{
+				keyIndex = exceptions[i].keyIndex;
+				break;
+			}
+		}
+
+		if (keyIndex == -1)
+			keyIndex = argc > 2 && atoi(string(argv[2], argvlen[2]).c_str()) > 0 ? 3 : 0;
+		else if (keyIndex == -2)
+		{
+			keyIndex = 0;
+			for (int i = 1; i < argc - 1 && keyIndex == 0; i++)
+			{
+				if (isRedisCommand(argv[i], argvlen[i], "STREAMS"))
+					keyIndex = i + 1;
+			}
+		}
+
+		if (keyIndex <= 0 || keyIndex >= argc)
+			return NULL;
+
+		*keyLength = argvlen[keyIndex];
+		return argv[keyIndex];
+	}
+
+	/**
+	 * How many arguments each key of a multi-key command takes, or 0 if the command
+	 * doesn't take several keys. A cluster splits these up by slot, a sharded target by shard.
+	 */
+	int getRedisMultiKeyStep(const char *command, size_t commandLength)
+	{
+		if (isRedisCommand(command, commandLength, "MGET") || isRedisCommand(command, commandLength, "DEL") ||
+			isRedisCommand(command, commandLength, "UNLINK") || isRedisCommand(command, commandLength, "EXISTS") ||
+			isRedisCommand(command, commandLength, "TOUCH"))
+			return 1;
+
+		return isRedisCommand(command, commandLength, "MSET") ? 2 : 0;
+	}
+
+	/**
+	 * Whether a command only reads, so a replica can answer it
+	 */
+	bool isRedisReadOnlyCommand(const char *command, size_t commandLength)
+	{
+		static const char *readOnly[] = {
+			"BITCOUNT", "BITFIELD_RO", "BITPOS", "DBSIZE", "DUMP", "EVAL_RO", "EVALSHA_RO", "EXISTS", "EXPIRETIME",
+			"FCALL_RO", "GEODIST", "GEOHASH", "GEOPOS", "GEORADIUS_RO", "GEORADIUSBYMEMBER_RO", "GEOSEARCH", "GET",
+			"GETBIT", "GETRANGE", "HEXISTS", "HGET", "HGETALL", "HKEYS", "HLEN", "HMGET", "HRANDFIELD", "HSCAN",
+			"HSTRLEN", "HVALS", "KEYS", "LCS", "LINDEX", "LLEN", "LPOS", "LRANGE", "MGET", "PEXPIRETIME", "PFCOUNT",
+			"PTTL", "RANDOMKEY", "SCAN", "SCARD", "SDIFF", "SINTER", "SINTERCARD", "SISMEMBER", "SMEMBERS",
+			"SMISMEMBER", "SORT_RO", "SRANDMEMBER", "SSCAN", "STRLEN", "SUBSTR", "SUNION", "TTL", "TYPE", "XLEN",
+			"XPENDING", "XRANGE", "XREVRANGE", "ZCARD", "ZCOUNT", "ZDIFF", "ZINTER", "ZINTERCARD", "ZLEXCOUNT",
+			"ZMSCORE", "ZRANDMEMBER", "ZRANGE", "ZRANGEBYLEX", "ZRANGEBYSCORE", "ZRANK", "ZREVRANGE", "ZREVRANGEBYLEX",
+			"ZREVRANGEBYSCORE", "ZREVRANK", "ZSCAN", "ZSCORE", "ZUNION"};
+
+		for (size_t i = 0; i < sizeof(readOnly) / sizeof(readOnly[0]); i++)
+		{
+			if (isRedisCommand(command, commandLength, readOnly[i]))
+				return true;
+		}
+
+		return false;
+	}
+
+	/**
+	 * Returns a cluster's node for host:port, adding it if the cluster didn't know it yet
+	 */
+	RedisEndpoint *findRedisClusterNode(RedisEndpoint *cluster, const string &host, int port)
+	{
+		char address[300];
+		snprintf(address, sizeof(address), "%s:%d", host.c_str(), port);
+
+		map<string, RedisEndpoint *>::iterator it = cluster->nodes.find(address);
+		if (it != cluster->nodes.end())
+			return it->second;
+
+		RedisEndpoint *node = newRedisEndpoint(address);
+		node->host = host;
+		node->port = port;
+		node->parent = cluster;
+		prepareRedisEndpoint(node);
+
+		cluster->nodes[address] = node;
+		return node;
+	}
+
+	/**
+	 * Loads a cluster's slot map with CLUSTER SLOTS from the first node that answers,
+	 * starting with the current default node. The node that answered becomes the default.
+	 */
+	bool refreshRedisClusterSlots(mvProgram program, RedisEndpoint *cluster)
+	{
+		cluster->slotsRefreshedAt = currentTimeMillis();
+
+		vector<RedisEndpoint *> candidates;
+		if (cluster->defaultNode != NULL)
+			candidates.push_back(cluster->defaultNode);
+
+		for (map<string, RedisEndpoint *>::iterator it = cluster->nodes.begin(); it != cluster->nodes.end(); it++)
+		{
+			if (it->second != cluster->defaultNode)
+				candidates.push_back(it->second);
+		}
+
+		for (size_t i = 0; i < candidates.size(); i++)
+		{
+			RedisEndpoint *node = candidates[i];
+			if (!useRedisEndpoint(program, NULL, node))
+				continue;
+
+			if (!node->pendingReplies.empty() && !drainRedisReplies(node, true))
+			{
+				failRedisEndpoint(node);
+				continue;
+			}
+
+			redisReply *reply = (redisReply *)redisCommand(node->context, "CLUSTER SLOTS");
+			if (reply == NULL)
+			{
+				failRedisEndpoint(node);
+				continue;
+			}
+
+			if (reply->type != REDIS_REPLY_ARRAY)
+			{
+				recordRedisError(ERROR_COMMAND, reply->type == REDIS_REPLY_ERROR ? reply->str : "Unexpected reply to CLUSTER SLOTS");
+				freeReplyObject(reply);
+				continue;
+			}
+
+			// Each range is [first slot, last slot, [master host, port, id], replicas...]
+			for (size_t j = 0; j < reply->elements; j++)
+			{
+				redisReply *range = reply->element[j];
+				if (range->type != REDIS_REPLY_ARRAY || range->elements < 3 || range->element[2]->type != REDIS_REPLY_ARRAY || range->element[2]->elements < 2)
+					continue;
+
+				redisReply *master = range->element[2];
+				string host(master->element[0]->str != NULL ? master->element[0]->str : "", master->element[0]->len);
+
+				// A node that doesn't know its own address means the one we asked
+				if (host.size() == 0 || host == "?")
+					host = node->host;
+
+				RedisEndpoint *owner = findRedisClusterNode(cluster, host, (int)master->element[1]->integer);
+				for (long long slot = range->element[0]->integer; slot <= range->element[1]->integer && slot < CLUSTER_SLOTS; slot++)
+					cluster->slots[slot] = owner;
+			}
+
+			freeReplyObject(reply);
+			cluster->defaultNode = node;
+			cluster->slotsStale = false;
+			return true;
+		}
+
+		return false;
+	}
+
+	/**
+	 * Starts a call on a cluster target: loads the slot map if it's missing or a MOVED
+	 * showed it out of date, and points _endpoint at the default node
+	 */
+	bool useRedisCluster(mvProgram program, mvVariable returnValue)
+	{
+		RedisEndpoint *cluster = _target;
+
+		// Pipelined replies of an earlier request are gone with its connections
+		if (cluster->checkedRequest != _persistent->requestCount)
+		{
+			cluster->checkedRequest = _persistent->requestCount;
+			cluster->replyOrder.clear();
+		}
+
+		if (cluster->slotsStale && (cluster->defaultNode == NULL || currentTimeMillis() - cluster->slotsRefreshedAt >= CLUSTER_REFRESH_MILLIS))
+			refreshRedisClusterSlots(program, cluster);
+
+		if (cluster->defaultNode != NULL && useRedisEndpoint(program, returnValue, cluster->defaultNode))
+			return true;
+
+		// The default node is down, another one can take over
+		if (refreshRedisClusterSlots(program, cluster) && useRedisEndpoint(program, returnValue, cluster->defaultNode))
+			return true;
+
+		setRedisError(ERROR_CONNECT_ERROR, "No node of redis cluster " + cluster->name + " could be reached!", program, returnValue);
+		return false;
+	}
+
+	/**
+	 * Starts a call on a sharded target: points _endpoint at the default shard, or else
+	 * any shard that can be reached. A shard that is down only fails the keys it holds,
+	 * they aren't moved to another shard that doesn't have them.
+	 */
+	bool useRedisShards(mvProgram program, mvVariable returnValue)
+	{
+		RedisEndpoint *shards = _target;
+
+		// Pipelined replies of an earlier request are gone with its connections
+		if (shards->checkedRequest != _persistent->requestCount)
+		{
+			shards->checkedRequest = _persistent->requestCount;
+			shards->replyOrder.clear();
+		}
+
+		if (useRedisEndpoint(program, NULL, shards->defaultNode))
+			return true;
+
+		for (map<string, RedisEndpoint *>::iterator it = shards->nodes.begin(); it != shards->nodes.end(); it++)
+		{
+			if (it->second != shards->defaultNode && useRedisEndpoint(program, NULL, it->second))
+				return true;
+		}
+
+		setRedisError(ERROR_CONNECT_ERROR, "No shard of redis target " + shards->name + " could be reached!", program, returnValue);
+		return false;
+	}
+
+	/**
+	 * The server of the current target a WATCH or MULTI keeps commands on, if any
+	 */
+	RedisEndpoint *getRedisTransactionNode()
+	{
+		if (_transactionNode != NULL && (_transactionNode == _target || _transactionNode->parent == _target))
+			return _transactionNode;
+
+		return NULL;
+	}
+
+	/**
+	 * The server a key is written to: for a cluster the node of its slot, for a sharded
+	 * target the first shard at or after its place on the ring (or for either, the node a
+	 * transaction is running on), otherwise the target itself, never one of its replicas
+	 */
+	RedisEndpoint *findRedisKeyEndpoint(const char *key, size_t keyLength)
+	{
+		if (_target->topology == RedisTopology_Single)
+			return _target;
+
+		RedisEndpoint *transactionNode = getRedisTransactionNode();
+		if (transactionNode != NULL)
+			return transactionNode;
+
+		if (_target->topology == RedisTopology_Sharded)
+		{
+			size_t tagLength;
+			const char *tag = findRedisHashTag(key, keyLength, &tagLength);
+			map<uint32_t, RedisEndpoint *>::iterator it = _target->ring.lower_bound(hashRedisRingKey(tag, tagLength));
+			return it != _target->ring.end() ? it->second : _target->ring.begin()->second;
+		}
+
+		RedisEndpoint *node = _target->slots[getRedisClusterSlot(key, keyLength)];
+		return node != NULL ? node : _target->defaultNode;
+	}
+
+	/**
+	 * The servers behind the current target: a cluster's nodes or the shards, otherwise
+	 * just the target
+	 */
+	vector<RedisEndpoint *> getRedisTargetServers()
+	{
+		vector<RedisEndpoint *> servers;
+		if (_target->topology == RedisTopology_Single)
+			servers.push_back(_target);
+
+		for (map<string, RedisEndpoint *>::iterator it = _target->nodes.begin(); it != _target->nodes.end(); it++)
+			servers.push_back(it->second);
+
+		return servers;
+	}
+
+	/**
+	 * The server reads of a single target go to: a replica picked at random once per
+	 * request, so a page's reads don't go back in time, or the primary itself when it has
+	 * no replicas, redis_require_primary is on, or no replica can be reached
+	 */
+	RedisEndpoint *findRedisReadEndpoint(mvProgram program)
+	{
+		RedisEndpoint *primary = _target;
+		if (_requirePrimary || primary->nodes.empty() || getRedisTransactionNode() != NULL)
+			return primary;
+
+		if (primary->readNode == NULL)
+		{
+			primary->readNode = primary;
+
+			map<string, RedisEndpoint *>::iterator it = primary->nodes.begin();
+			for (size_t skip = randomRedisNumber() % primary->nodes.size(); skip > 0; skip--)
+				it++;
+
+			for (size_t i = 0; i < primary->nodes.size() && primary->readNode == primary; i++)
+			{
+				if (useRedisEndpoint(program, NULL, it->second))
+					primary->readNode = it->second;
+				else if (++it == primary->nodes.end())
+					it = primary->nodes.begin();
+			}
+		}
+
+		return primary->readNode;
+	}
+
+	/**
+	 * Makes node the current endpoint for a command. A replica that went down during the
+	 * request leaves the rest of its reads to the primary.
+	 */
+	bool useRedisRoute(mvProgram program, mvVariable returnValue, RedisEndpoint *node)
+	{
+		if (useRedisEndpoint(program, returnValue, node))
+			return true;
+
+		if (node->parent == _target && _target->topology == RedisTopology_Single)
+		{
+			_target->readNode = _target;
+			if (useRedisEndpoint(program, returnValue, _target))
+				return true;
+		}
+
+		mvVariable_SetValue_Integer(returnValue, 0);
+		return false;
+	}
+
+	/**
+	 * Points _endpoint at the server a key lives on, before a wrapper touches the caches
+	 * or the socket for it. Reads of a target with replicas go to one of them.
+	 */
+	bool routeRedisKey(mvProgram program, mvVariable returnValue, const char *key, size_t keyLength, bool read)
+	{
+		if (_target->topology == RedisTopology_Single && _target->nodes.empty())
+			return true;
+
+		bool replicated = _target->topology == RedisTopology_Single;
+		return useRedisRoute(program, returnValue, read && replicated ? findRedisReadEndpoint(program) : findRedisKeyEndpoint(key, keyLength));
+	}
+
+	/**
+	 * Points _endpoint at the server a command belongs on. Read-only commands go to a
+	 * replica and the rest to the primary. On a cluster or sharded target keyless
+	 * commands go to the default node. WATCH and MULTI keep the rest of the transaction
+	 * on their node (or the primary).
+	 */
+	bool routeRedisCommand(mvProgram program, mvVariable returnValue, int argc, const char **argv, const size_t *argvlen)
+	{
+		if (_target->topology == RedisTopology_Single && _target->nodes.empty())
+			return true;
+
+		RedisEndpoint *node = getRedisTransactionNode();
+		if (node == NULL && _target->topology == RedisTopology_Single)
+			node = isRedisReadOnlyCommand(argv[0], argvlen[0]) ? findRedisReadEndpoint(program) : _target;
+		else if (node == NULL)
+		{
+			size_t keyLength;
+			const char *key = findRedisCommandKey(argc, argv, argvlen, &keyLength);
+			node = key != NULL ? findRedisKeyEndpoint(key, keyLength) : _target->defaultNode;
+		}
+
+		if (isRedisCommand(argv[0], argvlen[0], "WATCH") || isRedisCommand(argv[0], argvlen[0], "MULTI"))
+			_transactionNode = node;
+		else if (isRedisCommand(argv[0], argvlen[0], "EXEC") || isRedisCommand(argv[0], argvlen[0], "DISCARD") || isRedisCommand(argv[0], argvlen[0], "UNWATCH"))
+			_transactionNode = NULL;
+
+		return useRedisRoute(program, returnValue, node);
+	}
+
+	/**
+	 * Follows MOVED and ASK errors from a cluster node by resending the formatted command
+	 * to the node redis names, updating the slot map on MOVED. On return reply is the
+	 * final reply and node the node that sent it. Returns false (with the error recorded
+	 * and reply freed) if a node couldn't be reached. _endpoint is left as it was.
+	 */
+	bool followRedisRedirects(RedisEndpoint *cluster, redisReply **reply, RedisEndpoint **node, const char *command, size_t commandLength)
+	{
+		RedisEndpoint *endpoint = _endpoint;
+		redisContext *connection = _connection;
+		RedisEndpoint *origin = *node;
+		bool followed = true;
+
+		for (int hops = 0; followed && hops < CLUSTER_MAX_REDIRECTS && (*reply)->type == REDIS_REPLY_ERROR; hops++)
+		{
+			// MOVED <slot> <host>:<port> or ASK <slot> <host>:<port>
+			bool ask = strncmp((*reply)->str, "ASK ", 4) == 0;
+			if (!ask && strncmp((*reply)->str, "MOVED ", 6) != 0)
+				break;
+
+			const char *slotText = strchr((*reply)->str, ' ') + 1;
+			const char *address = strchr(slotText, ' ');
+			const char *port = address != NULL ? strrchr(address, ':') : NULL;
+			int slot = atoi(slotText);
+			if (port == NULL || slot < 0 || slot >= CLUSTER_SLOTS)
+				break;
+
+			RedisEndpoint *target = findRedisClusterNode(cluster, string(address + 1, port - address - 1), atoi(port + 1));
+			if (!ask)
+			{
+				cluster->slots[slot] = target;
+				cluster->slotsStale = true;
+			}
+
+			// The node whose replies are being read can't be sent to in the middle of them
+			if (target == origin && !target->pendingReplies.empty())
+				break;
+
+			if (!useRedisEndpoint(_persistent->lastProgram, NULL, target))
+			{
+				followed = false;
+				break;
+			}
+
+			if (ask)
+				redisAppendCommand(_connection, "ASKING");
+
+			redisReply *asking = NULL;
+			redisReply *redirected = NULL;
+			if ((!target->pendingReplies.empty() && !drainRedisReplies(target, true)) ||
+				redisAppendFormattedCommand(_connection, command, commandLength) != REDIS_OK ||
+				(ask && redisGetReply(_connection, (void **)&asking) != REDIS_OK) ||
+				redisGetReply(_connection, (void **)&redirected) != REDIS_OK)
+			{
+				failRedisEndpoint(target);
+				followed = false;
+			}
+			else
+			{
+				freeReplyObject(*reply);
+				*reply = redirected;
+				*node = target;
+			}
+
+			if (asking != NULL)
+				freeReplyObject(asking);
+		}
+
+		if (!followed)
+		{
+			freeReplyObject(*reply);
+			*reply = NULL;
+		}
+
+		_endpoint = endpoint;
+		_connection = endpoint != NULL ? endpoint->context : connection;
+		return followed;
+	}
+
+	/**
+	 * Runs a multi-key command (MGET, MSET, DEL, ...) on a cluster or sharded target by
+	 * splitting it into one command per slot or shard. Every part is sent before any reply
+	 * is read, so the nodes work in parallel. The replies are then combined: arrays in the original key order,
+	 * integers added up, and otherwise the first reply. keyStep is how many arguments
+	 * each key takes (2 for MSET's key value pairs).
+	 */
+	redisReply *scatterRedisCommand(mvProgram program, mvVariable returnValue, int argc, const char **argv, const size_t *argvlen, int keyStep)
+	{
+		// A cluster node only takes keys of one slot per command, a shard takes all of its own
+		map<pair<RedisEndpoint *, int>, vector<int> > partArguments;
+		for (int i = 1; i + keyStep <= argc; i += keyStep)
+		{
+			int slot = _target->topology == RedisTopology_Cluster ? getRedisClusterSlot(argv[i], argvlen[i]) : 0;
+			partArguments[make_pair(findRedisKeyEndpoint(argv[i], argvlen[i]), slot)].push_back(i);
+		}
+
+		vector<RedisScatterPart> parts(partArguments.size());
+		vector<const char *> partArgv;
+		vector<size_t> partArgvlen;
+
+		size_t count = 0;
+		for (map<pair<RedisEndpoint *, int>, vector<int> >::iterator it = partArguments.begin(); it != partArguments.end(); it++, count++)
+		{
+			RedisScatterPart &part = parts[count];
+			part.endpoint = it->first.first;
+			part.arguments.swap(it->second);
+			part.reply = NULL;
+
+			partArgv.assign(1, argv[0]);
+			partArgvlen.assign(1, argvlen[0]);
+			for (size_t j = 0; j < part.arguments.size(); j++)
+			{
+				partArgv.insert(partArgv.end(), argv + part.arguments[j], argv + part.arguments[j] + keyStep);
+				partArgvlen.insert(partArgvlen.end(), argvlen + part.arguments[j], argvlen + part.arguments[j] + keyStep);
+			}
+
+			char *command = NULL;
+			long long commandLength = redisFormatCommandArgv(&command, partArgv.size(), &partArgv[0], &partArgvlen[0]);
+			if (commandLength < 0)
+			{
+				setRedisError(ERROR_COMMAND, "Out of memory formatting a command!", program, returnValue);
+				return NULL;
+			}
+
+			part.command.assign(command, commandLength);
+			redisFreeCommand(command);
+		}
+
+		// Earlier appended commands' replies come first on each node, set them aside
+		size_t sent = 0;
+		bool failed = false;
+		for (; sent < parts.size() && !failed; sent++)
+		{
+			RedisScatterPart &part = parts[sent];
+			if (!useRedisEndpoint(program, returnValue, part.endpoint))
+				failed = true;
+			else if ((!_endpoint->pendingReplies.empty() && !drainRedisReplies(_endpoint, true)) ||
+					 redisAppendFormattedCommand(_connection, part.command.data(), part.command.size()) != REDIS_OK)
+			{
+				setRedisConnectionError(program, returnValue);
+				failed = true;
+			}
+		}
+
+		for (size_t i = 0; i < sent && !failed; i++)
+		{
+			int done = 0;
+			while (!done && !failed)
+			{
+				if (redisBufferWrite(parts[i].endpoint->context, &done) != REDIS_OK)
+				{
+					// Fail the node as it is, reconnecting would lose its error and count the new connection
+					_endpoint = parts[i].endpoint;
+					setRedisConnectionError(program, returnValue);
+					failed = true;
+				}
+			}
+		}
+
+		size_t received = 0;
+		for (; received < sent && !failed; received++)
+		{
+			RedisScatterPart &part = parts[received];
+			if (redisGetReply(part.endpoint->context, (void **)&part.reply) != REDIS_OK)
+			{
+				_endpoint = part.endpoint;
+				setRedisConnectionError(program, returnValue);
+				failed = true;
+			}
+		}
+
+		// Sent parts whose replies won't be read now are discarded when they arrive
+		for (size_t i = received; i < sent; i++)
+		{
+			if (parts[i].endpoint->context != NULL)
+			{
+				RedisPendingReply pending;
+				pending.wanted = false;
+				pending.stream = 0;
+				parts[i].endpoint->pendingReplies.push_back(pending);
+			}
+		}
+
+		// Now that every node's replies have been read, the ones sent to the wrong node can be resent
+		for (size_t i = 0; i < parts.size() && !failed; i++)
+		{
+			RedisScatterPart &part = parts[i];
+			if (part.reply->type == REDIS_REPLY_ERROR && !followRedisRedirects(_target, &part.reply, &part.endpoint, part.command.data(), part.command.size()))
+			{
+				mvVariable_SetValue_Integer(returnValue, 0);
+				failed = true;
+			}
+			else if (part.reply->type == REDIS_REPLY_ERROR)
+			{
+				setRedisError(ERROR_COMMAND, part.reply->str, program, returnValue);
+				failed = true;
+			}
+			else if (part.reply->type != parts[0].reply->type || (part.reply->type == REDIS_REPLY_ARRAY && part.reply->elements != part.arguments.size()))
+			{
+				setRedisError(ERROR_COMMAND, "Mismatched replies from the nodes of redis target " + _target->name + "!", program, returnValue);
+				failed = true;
+			}
+		}
+
+		redisReply *reply = NULL;
+		if (!failed && parts[0].reply->type == REDIS_REPLY_ARRAY)
+		{
+			reply = (redisReply *)calloc(1, sizeof(redisReply));
+			reply->type = REDIS_REPLY_ARRAY;
+			reply->elements = (argc - 1) / keyStep;
+			reply->element = (redisReply **)calloc(reply->elements, sizeof(redisReply *));
+
+			for (size_t i = 0; i < parts.size(); i++)
+			{
+				for (size_t j = 0; j < parts[i].arguments.size(); j++)
+				{
+					reply->element[(parts[i].arguments[j] - 1) / keyStep] = parts[i].reply->element[j];
+					parts[i].reply->element[j] = NULL;
+				}
+			}
+		}
+		else if (!failed)
+		{
+			reply = parts[0].reply;
+			parts[0].reply = NULL;
+
+			for (size_t i = 1; i < parts.size() && reply->type == REDIS_REPLY_INTEGER; i++)
+				reply->integer += parts[i].reply->integer;
+		}
+
+		for (size_t i = 0; i < parts.size(); i++)
+		{
+			if (parts[i].reply != NULL)
+				freeReplyObject(parts[i].reply);
+		}
+
+		return reply;
+	}
+
+	/**
+	 * Appends a command to the current endpoint's pipeline, flushing it once
+	 * pipeline_flush_commands or pipeline_flush_bytes is reached. Without wantReply the
+	 * reply is discarded when it arrives.
+	 */
+	bool appendRedisCommand(mvProgram program, mvVariable returnValue, int argc, const char **argv, const size_t *argvlen, bool wantReply)
+	{
+		if (!routeRedisCommand(program, returnValue, argc, argv, argvlen))
+			return false;
+
+		RedisPendingReply pending;
+		pending.wanted = wantReply;
+		pending.stream = 0;
+
+		bool appended;
+		if (_endpoint->parent != NULL && _endpoint->parent->topology == RedisTopology_Cluster)
+		{
+			// Cluster nodes keep the command to resend it if the node turns out to be wrong
+			char *command = NULL;
+			long long commandLength = redisFormatCommandArgv(&command, argc, argv, argvlen);
+			appended = commandLength >= 0 && redisAppendFormattedCommand(_connection, command, commandLength) == REDIS_OK;
+			if (appended)
+				pending.command.assign(command, commandLength);
+
+			if (command != NULL)
+				redisFreeCommand(command);
+		}
+		else
+		{
+			appended = redisAppendCommandArgv(_connection, argc, argv, argvlen) == REDIS_OK;
+		}
+
+		if (!appended)
+		{
+			setRedisConnectionError(program, returnValue);
+			return false;
+		}
+
+		_endpoint->pendingReplies.push_back(pending);
+		if (wantReply)
+		{
+			_endpoint->wantedReplies++;
+			if (!_target->nodes.empty())
+				_target->replyOrder.push_back(_endpoint);
+		}
+
+		_endpoint->unflushedCommands++;
+
+		const RedisOptions &options = _persistent->options;
+		bool flush = (options.pipelineFlushCommands > 0 && _endpoint->unflushedCommands >= options.pipelineFlushCommands) ||
+					 (options.pipelineFlushBytes > 0 && sdslen(_connection->obuf) >= (size_t)options.pipelineFlushBytes);
+
+		if (flush && !flushRedisPipeline(_endpoint))
+		{
+			setRedisConnectionError(program, returnValue);
+			return false;
+		}
+
+		// Nowait commands have no sync point of their own to write them
+		if (!wantReply && !sendRedisPipeline(_endpoint))
+		{
+			setRedisConnectionError(program, returnValue);
+			return false;
+		}
+
+		return true;
+	}
+
+	/**
+	 * Sends a command to the current endpoint, or for a cluster or sharded target to the
+	 * node it belongs on. Arguments are passed with explicit lengths, so there's no format string to
+	 * parse and values may contain NULs. Returns NULL (with the redis error set) on I/O
+	 * errors and error replies.
+	 */
+	redisReply *runRedisCommand(mvProgram program, mvVariable returnValue, int argc, const char **argv, const size_t *argvlen)
+	{
+		if (_target->topology != RedisTopology_Single && getRedisTransactionNode() == NULL)
+		{
+			int keyStep = getRedisMultiKeyStep(argv[0], argvlen[0]);
+			if (keyStep > 0 && argc > 1 + keyStep)
+				return scatterRedisCommand(program, returnValue, argc, argv, argvlen, keyStep);
+		}
+
+		if (!routeRedisCommand(program, returnValue, argc, argv, argvlen))
+			return NULL;
+
+		// Replies to earlier appended commands come first on the wire, set them aside
+		if (!_endpoint->pendingReplies.empty() && !drainRedisReplies(_endpoint, true))
+		{
+			setRedisConnectionError(program, returnValue);
+			return NULL;
+		}
+
+		redisReply *reply = (redisReply *)redisCommandArgv(_connection, argc, argv, argvlen);
+
+		// A sentinel endpoint's primary was demoted. Unless replies read ahead or a
+		// transaction are tied to the old connection, retry once on the new primary.
+		if (reply != NULL && isRedisReadOnlyError(reply) && _endpoint->sentinelMaster.size() > 0 && _endpoint->replies.empty() &&
+			_endpoint->replyOrder.empty() && getRedisTransactionNode() == NULL)
+		{
+			RedisEndpoint *endpoint = _endpoint;
+			string host = endpoint->host;
+			int port = endpoint->port;
+			endpoint->masterStale = true;
+
+			if (resolveRedisMaster(program, returnValue, endpoint, true) && (endpoint->host != host || endpoint->port != port))
+			{
+				freeReplyObject(reply);
+				if (!useRedisEndpoint(program, returnValue, endpoint))
+				{
+					mvVariable_SetValue_Integer(returnValue, 0);
+					return NULL;
+				}
+
+				reply = (redisReply *)redisCommandArgv(_connection, argc, argv, argvlen);
+			}
+		}
+
+		if (reply == NULL)
+		{
+			setRedisConnectionError(program, returnValue);
+			return NULL;
+		}
+
+		if (reply->type == REDIS_REPLY_ERROR && _endpoint->parent != NULL && _endpoint->parent->topology == RedisTopology_Cluster)
+		{
+			char *command = NULL;
+			long long commandLength = redisFormatCommandArgv(&command, argc, argv, argvlen);
+
+			RedisEndpoint *node = _endpoint;
+			bool followed = commandLength < 0 || followRedisRedirects(_endpoint->parent, &reply, &node, command, commandLength);
+			if (command != NULL)
+				redisFreeCommand(command);
+
+			if (!followed)
+			{
+				mvVariable_SetValue_Integer(returnValue, 0);
+				return NULL;
+			}
+
+			useRedisEndpoint(program, returnValue, node);
+		}
+
+		if (reply->type == REDIS_REPLY_ERROR)
+		{
+			setRedisError(ERROR_COMMAND, reply->str, program, returnValue);
+			freeReplyObject(reply);
+			return NULL;
+		}
+
+		return reply;
+	}
+
+	/**
+	 * Writes a value read from redis to the response, decompressing it first if needed.
+	 * Returns false (with the redis error set) if it is corrupt.
+	 */
+	bool outputRedisValue(mvProgram program, mvVariable returnValue, const char *value, size_t valueLength)
+	{
+		if (!isCompressedRedisValue(value, valueLength))
+		{
+			mvProgram_Output(program, value, valueLength);
+			return true;
+		}
+
+		size_t length;
+		char *decompressed = decompressRedisValue(value, valueLength, &length);
+		if (decompressed == NULL)
+		{
+			setRedisError(ERROR_MALFORMED_VALUE, "Compressed value is corrupt!", program, returnValue);
+			return false;
+		}
+
+		mvProgram_Output(program, decompressed, length);
+		free(decompressed);
+		return true;
+	}
+
+	/**
+	 * Reads up to size bytes from the current connection's socket, waiting at most
+	 * command_timeout for them. Returns false with the connection's error set on
+	 * timeouts, resets and EOF.
+	 */
+	bool readRedisSocket(char *buffer, size_t size, size_t *received)
+	{
+		while (true)
+		{
+			ssize_t count = read(_connection->fd, buffer, size);
+			if (count > 0)
+			{
+				*received = count;
+				return true;
+			}
+
+			if (count == 0)
+			{
+				_connection->err = REDIS_ERR_EOF;
+				snprintf(_connection->errstr, sizeof(_connection->errstr), "Server closed the connection");
+				return false;
+			}
+
+			if (errno != EINTR)
+			{
+				_connection->err = REDIS_ERR_IO;
+				snprintf(_connection->errstr, sizeof(_connection->errstr), "%s", strerror(errno));
+				return false;
+			}
+		}
+	}
+
+	/**
+	 * Writes the value of a GET reply to the response and frees the reply. Returns 1 if
+	 * found, -1 if not, and 0 (with the redis error set) on error, including a NULL reply.
+	 */
+	int outputRedisReply(mvProgram program, mvVariable returnValue, redisReply *reply)
+	{
+		if (reply == NULL)
+			return 0;
+
+		int result = -1;
+		if (reply->type == REDIS_REPLY_STRING)
+			result = outputRedisValue(program, returnValue, reply->str, reply->len) ? 1 : 0;
+		else if (reply->type != REDIS_REPLY_NIL)
+		{
+			setRedisError(ERROR_COMMAND, "Redis did not return with the proper type REDIS_REPLY_STRING", program, returnValue);
+			result = 0;
+		}
+
+		freeReplyObject(reply);
+		return result;
+	}
+
+	/**
+	 * How much the next read into _streamBuffer may take after the available bytes: the
+	 * rest of the reply, but never more than the room left in the buffer
+	 */
+	size_t getRedisStreamReadSize(size_t available, size_t remaining)
+	{
+		size_t room = STREAM_CHUNK_SIZE - available;
+		return remaining - available < room ? remaining - available : room;
+	}
+
+	/**
+	 * GETs a key and writes its value to the response as it comes off the socket, so
+	 * neither hiredis nor the VM ever holds the whole value. Compressed values have to be
+	 * read in full to be expanded. Returns 1 if found, -1 if not, and 0 (with the redis
+	 * error set) on error.
+	 */
+	int streamRedisValue(mvProgram program, mvVariable returnValue, const char *key, int keyLength)
+	{
+		if (!_endpoint->pendingReplies.empty() && !drainRedisReplies(_endpoint, true))
+		{
+			setRedisConnectionError(program, returnValue);
+			return 0;
+		}
+
+		const char *argv[] = {"GET", key};
+		const size_t argvlen[] = {3, (size_t)keyLength};
+
+		// Bytes hiredis has read ahead would come before the reply, let it parse this one
+		redisReader *reader = _connection->reader;
+		if (reader->pos != reader->len)
+			return outputRedisReply(program, returnValue, runRedisCommand(program, returnValue, 2, argv, argvlen));
+
+		int done = 0;
+		if (redisAppendCommandArgv(_connection, 2, argv, argvlen) != REDIS_OK)
+		{
+			setRedisConnectionError(program, returnValue);
+			return 0;
+		}
+
+		while (!done)
+		{
+			if (redisBufferWrite(_connection, &done) != REDIS_OK)
+			{
+				setRedisConnectionError(program, returnValue);
+				return 0;
+			}
+		}
+
+		_streamBuffer.resize(STREAM_CHUNK_SIZE);
+		char *buffer = &_streamBuffer[0];
+		size_t buffered = 0;
+		size_t received;
+
+		// Nothing else is in flight, so whatever arrives is this reply
+		char *headerEnd;
+		while ((headerEnd = (char *)memmem(buffer, buffered, "\r\n", 2)) == NULL)
+		{
+			if (buffered == STREAM_CHUNK_SIZE || !readRedisSocket(buffer + buffered, STREAM_CHUNK_SIZE - buffered, &received))
+			{
+				if (buffered == STREAM_CHUNK_SIZE)
+				{
+					_connection->err = REDIS_ERR_PROTOCOL;
+					snprintf(_connection->errstr, sizeof(_connection->errstr), "Reply header too long");
+				}
+
+				setRedisConnectionError(program, returnValue);
+				return 0;
+			}
+
+			buffered += received;
+		}
+
+		*headerEnd = '\0';
+		if (buffer[0] == '-' && _endpoint->parent != NULL && _endpoint->parent->topology == RedisTopology_Cluster && (strncmp(buffer + 1, "MOVED ", 6) == 0 || strncmp(buffer + 1, "ASK ", 4) == 0))
+		{
+			// The key is on another cluster node, whose reply is read whole
+			redisReply *reply = (redisReply *)calloc(1, sizeof(redisReply));
+			reply->type = REDIS_REPLY_ERROR;
+			reply->len = headerEnd - buffer - 1;
+			reply->str = strdup(buffer + 1);
+
+			char *command = NULL;
+			long long commandLength = redisFormatCommandArgv(&command, 2, argv, argvlen);
+
+			RedisEndpoint *node = _endpoint;
+			bool followed = commandLength >= 0 && followRedisRedirects(_endpoint->parent, &reply, &node, command, commandLength);
+			if (command != NULL)
+				redisFreeCommand(command);
+
+			if (!followed)
+			{
+				if (reply != NULL)
+					freeReplyObject(reply);
+
+				mvVariable_SetValue_Integer(returnValue, 0);
+				return 0;
+			}
+
+			if (reply->type == REDIS_REPLY_ERROR)
+			{
+				setRedisError(ERROR_COMMAND, reply->str, program, returnValue);
+				freeReplyObject(reply);
+				return 0;
+			}
+
+			return outputRedisReply(program, returnValue, reply);
+		}
+
+		if (buffer[0] == '-')
+		{
+			setRedisError(ERROR_COMMAND, buffer + 1, program, returnValue);
+			return 0;
+		}
+
+		char *lengthEnd;
+		long long valueLength = strtoll(buffer + 1, &lengthEnd, 10);
+		if (buffer[0] != '$' || lengthEnd != headerEnd || valueLength < -1)
+		{
+			_connection->err = REDIS_ERR_PROTOCOL;
+			snprintf(_connection->errstr, sizeof(_connection->errstr), "Unexpected reply to GET");
+			setRedisConnectionError(program, returnValue);
+			return 0;
+		}
+
+		if (valueLength == -1)
+			return -1;
+
+		// What's left of the value, then its CRLF
+		size_t headerLength = headerEnd + 2 - buffer;
+		size_t available = buffered - headerLength;
+		size_t remaining = valueLength + 2;
+		memmove(buffer, buffer + headerLength, available);
+
+		// Enough of the value to tell whether it's compressed
+		size_t magicLength = valueLength > COMPRESS_MAGIC_LENGTH ? COMPRESS_MAGIC_LENGTH + 1 : 0;
+		while (available < magicLength)
+		{
+			if (!readRedisSocket(buffer + available, getRedisStreamReadSize(available, remaining), &received))
+			{
+				setRedisConnectionError(program, returnValue);
+				return 0;
+			}
+
+			available += received;
+		}
+
+		bool compressed = magicLength > 0 && isCompressedRedisValue(buffer, magicLength);
+		if (compressed)
+		{
+			_compressBuffer.clear();
+			_compressBuffer.reserve(valueLength);
+		}
+
+		while (true)
+		{
+			if (available > remaining)
+			{
+				_connection->err = REDIS_ERR_PROTOCOL;
+				snprintf(_connection->errstr, sizeof(_connection->errstr), "Unexpected data after reply to GET");
+				setRedisConnectionError(program, returnValue);
+				return 0;
+			}
+
+			// The last read may end partway through the CRLF
+			size_t valuePart = remaining <= 2 ? 0 : available < remaining - 2 ? available : remaining - 2;
+			if (compressed)
+				_compressBuffer.append(buffer, valuePart);
+			else if (valuePart > 0)
+				mvProgram_Output(program, buffer, valuePart);
+
+			remaining -= available;
+			if (remaining == 0)
+				break;
+
+			if (!readRedisSocket(buffer, getRedisStreamReadSize(0, remaining), &received))
+			{
+				setRedisConnectionError(program, returnValue);
+				return 0;
+			}
+
+			available = received;
+		}
+
+		if (compressed && !outputRedisValue(program, returnValue, _compressBuffer.data(), _compressBuffer.size()))
+			return 0;
+
+		return 1;
+	}
+
+	/**
+	 * Writes to the current connection's socket, waiting at most command_timeout for room.
+	 * Returns false with the connection's error set on failure.
+	 */
+	bool writeRedisSocket(const char *data, size_t length)
+	{
+		while (length > 0)
+		{
+			ssize_t count = write(_connection->fd, data, length);
+			if (count < 0)
+			{
+				if (errno == EINTR)
+					continue;
+
+				_connection->err = REDIS_ERR_IO;
+				snprintf(_connection->errstr, sizeof(_connection->errstr), "%s", strerror(errno));
+				return false;
+			}
+
+			data += count;
+			length -= count;
+		}
+
+		return true;
+	}
+
+	/**
+	 * Starts a "command key value" whose value is written to the socket afterwards with
+	 * writeRedisSocket, followed by a CRLF, instead of being formatted by hiredis. Anything
+	 * hiredis still has buffered is sent first so commands stay in order. Returns false
+	 * with the connection's error set on failure.
+	 */
+	bool startRedisStreamCommand(const char *command, size_t commandLength, const char *key, size_t keyLength, size_t valueLength)
+	{
+		if (sdslen(_connection->obuf) > 0 && !flushRedisPipeline(_endpoint))
+			return false;
+
+		char header[64];
+		int headerLength = snprintf(header, sizeof(header), "*3\r\n$%u\r\n", (unsigned int)commandLength);
+		if (!writeRedisSocket(header, headerLength) || !writeRedisSocket(command, commandLength))
+			return false;
+
+		headerLength = snprintf(header, sizeof(header), "\r\n$%u\r\n", (unsigned int)keyLength);
+		if (!writeRedisSocket(header, headerLength) || !writeRedisSocket(key, keyLength))
+			return false;
+
+		headerLength = snprintf(header, sizeof(header), "\r\n$%llu\r\n", (unsigned long long)valueLength);
+		return writeRedisSocket(header, headerLength);
+	}
+
+	/**
+	 * Stores a variable in redis_set_var's format, compressed if it is large enough.
+	 * Returns false (with the redis error set) on failure.
+	 */
+	bool setRedisVar(mvProgram program, mvVariable returnValue, const char *key, int keyLength, mvVariable value, int expires)
+	{
+		forgetRedisCacheEntry(findRedisKeyEndpoint(key, keyLength), key, keyLength);
+
+		_encodeBuffer.assign(VAR_CODEC_MAGIC, VAR_CODEC_MAGIC_LENGTH);
+		encodeRedisVariable(_encodeBuffer, value);
+
+		if (compressRedisValue(_encodeBuffer.data(), _encodeBuffer.size(), _compressBuffer))
+			_encodeBuffer.swap(_compressBuffer);
+
+		char expiresText[16];
+		int expiresLength = snprintf(expiresText, sizeof(expiresText), "%d", expires);
+
+		// No EX when the value shouldn't expire
+		const char *argv[] = {"SET", key, _encodeBuffer.data(), "EX", expiresText};
+		const size_t argvlen[] = {3, (size_t)keyLength, _encodeBuffer.size(), 2, (size_t)expiresLength};
+		redisReply *reply = runRedisCommand(program, returnValue, expires > 0 ? 5 : 3, argv, argvlen);
+		if (reply == NULL)
+			return false;
+
+		freeReplyObject(reply);
+		return true;
+	}
+
+	/**
+	 * Reads a value stored by setRedisVar into ret, from the local or shared cache when
+	 * it's there. Returns 1 if found, -1 if not, and 0 (with the redis error set) on error.
+	 */
+	int getRedisVar(mvProgram program, mvVariable returnValue, const char *key, int keyLength, mvVariable ret)
+	{
+		if (!routeRedisKey(program, returnValue, key, keyLength, true))
+			return 0;
+
+		const string *cached = findRedisCacheEntry(_endpoint, key, keyLength);
+		if (cached != NULL)
+			return decodeRedisVarValue(program, returnValue, cached->data(), cached->size(), ret) ? 1 : 0;
+
+		size_t sharedLength;
+		char *shared = findSharedCacheEntry(_endpoint, key, keyLength, &sharedLength);
+		if (shared != NULL)
+		{
+			bool decoded = decodeRedisVarValue(program, returnValue, shared, sharedLength, ret);
+			free(shared);
+			return decoded ? 1 : 0;
+		}
+
+		const char *argv[] = {"GET", key};
+		const size_t argvlen[] = {3, (size_t)keyLength};
+		redisReply *reply = runRedisCommand(program, returnValue, 2, argv, argvlen);
+		if (reply == NULL)
+			return 0;
+
+		if (reply->type == REDIS_REPLY_NIL)
+		{
+			freeReplyObject(reply);
+			return -1;
+		}
+
+		if (reply->type != REDIS_REPLY_STRING)
+		{
+			setRedisError(ERROR_COMMAND, "Redis did not return with the proper type REDIS_REPLY_STRING", program, returnValue);
+			freeReplyObject(reply);
+			return 0;
+		}
+
+		if (isCompressedRedisValue(reply->str, reply->len))
+		{
+			size_t length;
+			char *decompressed = decompressRedisValue(reply->str, reply->len, &length);
+			if (decompressed == NULL)
+			{
+				setRedisError(ERROR_MALFORMED_VALUE, "Compressed value is corrupt!", program, returnValue);
+				freeReplyObject(reply);
+				return 0;
+			}
+
+			free(reply->str);
+			reply->str = decompressed;
+			reply->len = length;
+		}
+
+		bool decoded = decodeRedisVarValue(program, returnValue, reply->str, reply->len, ret);
+		if (decoded)
+		{
+			storeRedisCacheEntry(_endpoint, key, keyLength, reply->str, reply->len);
+			storeSharedCacheEntry(_endpoint, key, keyLength, reply->str, reply->len);
+		}
+
+		freeReplyObject(reply);
+		return decoded ? 1 : 0;
+	}
+
+	/**
+	 * Reads a redis_cache_fetch value into result. Returns 1 if found, with when it stops
+	 * being fresh and how long it took to compute, 0 if not found, and -1 on error.
+	 */
+	int readRedisCacheFetchValue(mvProgram program, mvVariable returnValue, const string &key, mvVariable result, int64_t *freshUntil, int32_t *computeTime)
+	{
+		const char *argv[] = {"GET", key.data()};
+		const size_t argvlen[] = {3, key.size()};
+		redisReply *reply = runRedisCommand(program, returnValue, 2, argv, argvlen);
+		if (reply == NULL)
+			return -1;
+
+		if (reply->type == REDIS_REPLY_NIL)
+		{
+			freeReplyObject(reply);
+			return 0;
+		}
+
+		if (reply->type == REDIS_REPLY_STRING && isCompressedRedisValue(reply->str, reply->len))
+		{
+			size_t length;
+			char *decompressed = decompressRedisValue(reply->str, reply->len, &length);
+			if (decompressed == NULL)
+			{
+				setRedisError(ERROR_MALFORMED_VALUE, "Compressed value is corrupt!", program, returnValue);
+				freeReplyObject(reply);
+				return -1;
+			}
+
+			free(reply->str);
+			reply->str = decompressed;
+			reply->len = length;
+		}
+
+		size_t headerLength = CACHE_FETCH_MAGIC_LENGTH + sizeof(*freshUntil) + sizeof(*computeTime);
+		if (reply->type != REDIS_REPLY_STRING || reply->len < headerLength || memcmp(reply->str, CACHE_FETCH_MAGIC, CACHE_FETCH_MAGIC_LENGTH) != 0)
+		{
+			setRedisError(ERROR_MALFORMED_VALUE, "Value was not written by redis_cache_fetch!", program, returnValue);
+			freeReplyObject(reply);
+			return -1;
+		}
+
+		memcpy(freshUntil, reply->str + CACHE_FETCH_MAGIC_LENGTH, sizeof(*freshUntil));
+		memcpy(computeTime, reply->str + CACHE_FETCH_MAGIC_LENGTH + sizeof(*freshUntil), sizeof(*computeTime));
+
+		bool decoded = decodeRedisVarValue(program, returnValue, reply->str + headerLength, reply->len - headerLength, result);
+		freeReplyObject(reply);
+		return decoded ? 1 : -1;
+	}
+
+	/**
+	 * Probabilistic early expiration (XFetch): a value is rebuilt once it is stale, and
+	 * before that with a probability that rises as expiry nears, sooner for values that
+	 * take longer to compute. Spreads rebuilds of a hot key over the workers' requests.
+	 */
+	bool isRedisCacheFetchDue(int64_t freshUntil, int32_t computeTime)
+	{
+		double random = (randomRedisNumber() % 1000000 + 1) / 1000000.0;
+		return wallTimeMillis() - computeTime * log(random) >= freshUntil;
+	}
+
+	/**
+	 * Takes the rebuild lock for a key with SET NX PX. Returns 1 if taken, 0 if another
+	 * worker holds it, and -1 on error.
+	 */
+	int lockRedisCacheFetch(mvProgram program, mvVariable returnValue, const string &lockKey, string &token)
+	{
+		char buffer[64];
+		int64_t now = currentTimeMillis();
+		token.assign(buffer, snprintf(buffer, sizeof(buffer), "%d:%lld:%llu", (int)getpid(), (long long)now, (unsigned long long)randomRedisNumber()));
+
+		char timeout[16];
+		int timeoutLength = snprintf(timeout, sizeof(timeout), "%d", _persistent->options.cacheLockTimeout > 0 ? _persistent->options.cacheLockTimeout : 1);
+
+		const char *argv[] = {"SET", lockKey.data(), token.data(), "NX", "PX", timeout};
+		const size_t argvlen[] = {3, lockKey.size(), token.size(), 2, 2, (size_t)timeoutLength};
+		redisReply *reply = runRedisCommand(program, returnValue, 6, argv, argvlen);
+		if (reply == NULL)
+			return -1;
+
+		bool locked = reply->type == REDIS_REPLY_STATUS;
+		freeReplyObject(reply);
+		return locked;
+	}
+
+	/**
+	 * Releases the rebuild lock, unless it timed out and another worker has taken it since
+	 */
+	void unlockRedisCacheFetch(mvProgram program, mvVariable returnValue, const string &lockKey, const string &token)
+	{
+		static const char *script = "if redis.call('get', KEYS[1]) == ARGV[1] then return redis.call('del', KEYS[1]) end return 0";
+
+		const char *argv[] = {"EVAL", script, "1", lockKey.data(), token.data()};
+		const size_t argvlen[] = {4, strlen(script), 1, lockKey.size(), token.size()};
+		redisReply *reply = runRedisCommand(program, returnValue, 5, argv, argvlen);
+		if (reply != NULL)
+			freeReplyObject(reply);
+	}
+
+	/**
+	 * A rebuild lock held by redis_cache_fetch, released however the rebuild ends. Errors
+	 * releasing it are recorded without changing the function's return value; a lock that
+	 * can't be released expires after cache_lock_timeout.
+	 */
+	struct RedisCacheFetchLock
+	{
+		mvProgram program;
+		string key;
+		string token;
+		bool held;
+
+		~RedisCacheFetchLock()
+		{
+			if (held)
+				unlockRedisCacheFetch(program, NULL, key, token);
+		}
+	};
+
+	bool isRedisEnabled(mvProgram program, mvVariable returnValue);
+
+	/**
+	 * Comes back to the target a MivaScript callback was started from. The callback may
+	 * have switched targets or caused redis.dat to be reloaded, which frees the endpoints,
+	 * so the target is looked up again by name.
+	 */
+	bool restoreRedisTarget(mvProgram program, mvVariable returnValue, const string &name)
+	{
+		map<string, RedisEndpoint *>::iterator it = _persistent->endpoints.find(name);
+		if (it == _persistent->endpoints.end())
+		{
+			setRedisError(ERROR_UNKNOWN_TARGET, "Redis target '" + name + "' is no longer in redis.dat!", program, returnValue);
+			return false;
+		}
+
+		_target = it->second;
+		return isRedisEnabled(program, returnValue);
+	}
+
+	/**
+	 * Resets per request state on the first call of each request
+	 */
+	void beginRedisRequest(mvProgram program)
+	{
+		getPersistentState(program);
+
+		mvVariableHash system = mvProgram_System_VariableHash(program);
+		if (_persistent->lastProgram == program && (system == NULL || mvVariableHash_Find(system, REQUEST_MARKER, REQUEST_MARKER_LENGTH) != NULL))
+			return;
+
+		if (system != NULL)
+			mvVariableHash_SetVariable(system, REQUEST_MARKER, REQUEST_MARKER_LENGTH, "1", 1);
+
+		_persistent->lastProgram = program;
+		_persistent->requestCount++;
+		_target = NULL;
+		_endpoint = NULL;
+		_connection = NULL;
+		_transactionNode = NULL;
+		_status = RedisStatus_Unknown;
+		_flatReplies = false;
+		_requirePrimary = false;
+		_lastReplyType = 0;
+		_outputCaptures.clear();
+		_appendStream.target = NULL;
+	}
+
+	/**
+	 * Loads redis.dat (if needed) for the current request
+	 */
+	bool loadRedisState(mvProgram program, mvVariable returnValue)
+	{
+		beginRedisRequest(program);
+
+		if (_status == RedisStatus_Unknown)
+			_status = loadRedisConfig(program, returnValue) ? RedisStatus_Enabled : RedisStatus_Disabled;
+
+		return _status == RedisStatus_Enabled;
+	}
+
+	bool isRedisEnabled(mvProgram program, mvVariable returnValue)
+	{
+		if (!loadRedisState(program, returnValue))
+			return false;
+
+		if (_target == NULL)
+		{
+			map<string, RedisEndpoint *>::iterator it = _persistent->endpoints.find(DEFAULT_TARGET);
+			if (it == _persistent->endpoints.end())
+			{
+				setRedisError(ERROR_UNKNOWN_TARGET, "No default redis target in redis.dat, use redis_target!", program, returnValue);
+				return false;
+			}
+
+			_target = it->second;
+		}
+
+		if (_target->topology == RedisTopology_Cluster)
+			return useRedisCluster(program, returnValue);
+
+		if (_target->topology == RedisTopology_Sharded)
+			return useRedisShards(program, returnValue);
+
+		if (useRedisEndpoint(program, returnValue, _target))
+			return true;
+
+		// Reads can still go to a replica while the primary is down
+		return !_target->nodes.empty() && findRedisReadEndpoint(program) != _target && useRedisEndpoint(program, NULL, _target->readNode);
+	}
+
+	/**
+	 * -----------------------------------------
+	 * redis_is_enabled
+	 * -----------------------------------------
+	 */
+	MV_EL_FunctionParameter redis_is_enabled_parameters[] = {
+		{}};
+	void redis_is_enabled(mvProgram program, mvVariableHash parameters, mvVariable returnValue, void **pdata)
+	{
+		mvVariable_SetValue_Integer(returnValue, isRedisEnabled(program, returnValue));
+	}
+
+	/**
+	 * -----------------------------------------
+	 * redis_target
+	 * -----------------------------------------
+	 */
+	MV_EL_FunctionParameter redis_target_parameters[] = {
+		{"name", 4, EPF_NORMAL}};
+	void redis_target(mvProgram program, mvVariableHash parameters, mvVariable returnValue, void **pdata)
+	{
+		if (!loadRedisState(program, returnValue))
+		{
+			mvVariable_SetValue_Integer(returnValue, 0);
+			return;
+		}
+
+		int nameLength = 0;
+		const char *name = mvVariable_Value(mvVariableHash_Index(parameters, 0), &nameLength);
+
+		map<string, RedisEndpoint *>::iterator it = _persistent->endpoints.find(nameLength == 0 ? string(DEFAULT_TARGET) : string(name, nameLength));
+		if (it == _persistent->endpoints.end())
+		{
+			setRedisError(ERROR_UNKNOWN_TARGET, "Unknown redis target '" + string(name, nameLength) + "'!", program, returnValue);
+			return;
+		}
+
+		_target = it->second;
+		_endpoint = NULL;
+		_connection = NULL;
+		mvVariable_SetValue_Integer(returnValue, 1);
+	}
+
+	/**
+	 * -----------------------------------------
+	 * redis_flat_replies
+	 * -----------------------------------------
+	 */
+	MV_EL_FunctionParameter redis_flat_replies_parameters[] = {
+		{"enabled", 7, EPF_NORMAL}};
+	void redis_flat_replies(mvProgram program, mvVariableHash parameters, mvVariable returnValue, void **pdata)
+	{
+		beginRedisRequest(program);
+
+		mvVariable_SetValue_Integer(returnValue, _flatReplies);
+		_flatReplies = mvVariable_Value_Integer(mvVariableHash_Index(parameters, 0)) != 0;
+	}
+
+	/**
+	 * -----------------------------------------
+	 * redis_require_primary
+	 * -----------------------------------------
+	 */
+	MV_EL_FunctionParameter redis_require_primary_parameters[] = {
+		{"enabled", 7, EPF_NORMAL}};
+	void redis_require_primary(mvProgram program, mvVariableHash parameters, mvVariable returnValue, void **pdata)
+	{
+		beginRedisRequest(program);
+
+		mvVariable_SetValue_Integer(returnValue, _requirePrimary);
+		_requirePrimary = mvVariable_Value_Integer(mvVariableHash_Index(parameters, 0)) != 0;
+	}
+
+	/**
+	 * -----------------------------------------
+	 * redis_reply_type
+	 * -----------------------------------------
+	 */
+	MV_EL_FunctionParameter redis_reply_type_parameters[] = {};
+	void redis_reply_type(mvProgram program, mvVariableHash parameters, mvVariable returnValue, void **pdata)
+	{
+		beginRedisRequest(program);
+
+		mvVariable_SetValue_Integer(returnValue, _lastReplyType);
+	}
+
+	/**
+	 * -----------------------------------------
+	 * redis_last_error
+	 * -----------------------------------------
+	 */
+	MV_EL_FunctionParameter redis_error_parameters[] = {
+		{"message", 7, EPF_REFERENCE}};
+	void redis_error(mvProgram program, mvVariableHash parameters, mvVariable returnValue, void **pdata)
+	{
+		mvVariable_SetValue_Integer(returnValue, _lastRedisErrorCode);
+
+		if (_lastRedisErrorCode != 0)
+		{
+			mvVariable_SetValue(mvVariableHash_Index(parameters, 0), _lastRedisError.c_str(), _lastRedisError.size());
+		}
+	}
+
+	/**
+	 * -----------------------------------------
+	 * redis_clear_error
+	 * -----------------------------------------
+	 */
+	MV_EL_FunctionParameter redis_error_clear_parameters[] = {};
+	void redis_error_clear(mvProgram program, mvVariableHash parameters, mvVariable returnValue, void **pdata)
+	{
+		_lastRedisError = "";
+		_lastRedisErrorCode = 0;
+	}
+
+	/**
+	 * -----------------------------------------
+	 * redis_free
+	 * -----------------------------------------
+	 */
+	MV_EL_FunctionParameter redis_free_parameters[] = {};
+	void redis_free(mvProgram program, mvVariableHash parameters, mvVariable returnValue, void **pdata)
+	{
+		if (!isRedisEnabled(program, returnValue))
+		{
+			mvVariable_SetValue_Integer(returnValue, 0);
+			return;
+		}
+
+		vector<RedisEndpoint *> servers = getRedisTargetServers();
+		for (size_t i = 0; i < servers.size(); i++)
+			freeRedisConnection(servers[i]);
+
+		_target->replyOrder.clear();
+		mvVariable_SetValue_Integer(returnValue, 1);
+	}
+
+	/**
+	 * -----------------------------------------
+	 * redis
+	 * -----------------------------------------
+	 */
+	MV_EL_FunctionParameter redis_command_parameters[] = {
+		{"command", 7, EPF_NORMAL},
+		{"args", 4, EPF_NORMAL}};
+	void redis_command(mvProgram program, mvVariableHash parameters, mvVariable returnValue, void **pdata)
+	{
+		if (!isRedisEnabled(program, returnValue))
+		{
+			mvVariable_SetValue_Integer(returnValue, 0);
+			return;
+		}
+
+		if (_connection == NULL)
+		{
+			setRedisError(ERROR_NOT_CONNECTED, "Not connected! Use redis_connect!", program, returnValue);
+			return;
+		}
+
+		int commandLength = 0;
+		const char *command = mvVariable_Value(mvVariableHash_Index(parameters, 0), &commandLength);
+
+		int argsLength = 0;
+		const char *args = mvVariable_Value(mvVariableHash_Index(parameters, 1), &argsLength);
+
+		RedisCommandTemplate *commandTemplate = getRedisCommandTemplate(program, returnValue, command, commandLength, args, argsLength);
+		if (commandTemplate == NULL)
+			return;
+
+		buildRedisArgv(program, commandTemplate);
+
+		// invoke command!
+		redisReply *reply = runRedisCommand(program, returnValue, _argv.size(), &_argv[0], &_argvlen[0]);
+		releaseRedisCommandTemplate(commandTemplate);
+		if (reply == NULL)
+			return;
+
+		returnRedisReply(reply, returnValue);
+		freeReplyObject(reply);
+	}
+
+	/**
+	 * -----------------------------------------
+	 * redis_append
+	 * -----------------------------------------
+	 */
+	MV_EL_FunctionParameter redis_command_append_parameters[] = {
+		{"command", 7, EPF_NORMAL},
+		{"args", 4, EPF_NORMAL}};
+	void redis_command_append(mvProgram program, mvVariableHash parameters, mvVariable returnValue, void **pdata)
+	{
+		if (!isRedisEnabled(program, returnValue))
+		{
+			mvVariable_SetValue_Integer(returnValue, 0);
+			return;
+		}
+
+		if (_connection == NULL)
+		{
+			setRedisError(ERROR_NOT_CONNECTED, "Not connected! Use redis_connect!", program, returnValue);
+			return;
+		}
+
+		int commandLength = 0;
+		const char *command = mvVariable_Value(mvVariableHash_Index(parameters, 0), &commandLength);
+
+		int argsLength = 0;
+		const char *args = mvVariable_Value(mvVariableHash_Index(parameters, 1), &argsLength);
+
+		RedisCommandTemplate *commandTemplate = getRedisCommandTemplate(program, returnValue, command, commandLength, args, argsLength);
+		if (commandTemplate == NULL)
+			return;
+
+		buildRedisArgv(program, commandTemplate);
+
+		// Append command to be invoked...
+		appendRedisCommand(program, returnValue, _argv.size(), &_argv[0], &_argvlen[0], true);
+		releaseRedisCommandTemplate(commandTemplate);
+	}
+
+	/**
+	 * -----------------------------------------
+	 * redis_commandv
+	 * -----------------------------------------
+	 */
+	MV_EL_FunctionParameter redis_commandv_parameters[] = {
+		{"command", 7, EPF_REFERENCE}};
+	void redis_commandv(mvProgram program, mvVariableHash parameters, mvVariable returnValue, void **pdata)
+	{
+		if (!isRedisEnabled(program, returnValue))
+		{
+			mvVariable_SetValue_Integer(returnValue, 0);
+			return;
+		}
+
+		if (_connection == NULL)
+		{
+			setRedisError(ERROR_NOT_CONNECTED, "Not connected! Use redis_connect!", program, returnValue);
+			return;
+		}
+
+		if (!buildRedisArgvFromArray(mvVariableHash_Index(parameters, 0)))
+		{
+			setRedisError(ERROR_MALFORMED_COMMAND, "redis_commandv expects a non-empty array!", program, returnValue);
+			return;
+		}
+
+		redisReply *reply = runRedisCommand(program, returnValue, _argv.size(), &_argv[0], &_argvlen[0]);
+		if (reply == NULL)
+			return;
+
+		returnRedisReply(reply, returnValue);
+		freeReplyObject(reply);
+	}
+
+	/**
+	 * -----------------------------------------
+	 * redis_commandv_append
+	 * -----------------------------------------
+	 */
+	MV_EL_FunctionParameter redis_commandv_append_parameters[] = {
+		{"command", 7, EPF_REFERENCE}};
+	void redis_commandv_append(mvProgram program, mvVariableHash parameters, mvVariable returnValue, void **pdata)
+	{
+		if (!isRedisEnabled(program, returnValue))
+		{
+			mvVariable_SetValue_Integer(returnValue, 0);
+			return;
+		}
+
+		if (_connection == NULL)
+		{
+			setRedisError(ERROR_NOT_CONNECTED, "Not connected! Use redis_connect!", program, returnValue);
+			return;
+		}
+
+		if (!buildRedisArgvFromArray(mvVariableHash_Index(parameters, 0)))
+		{
+			setRedisError(ERROR_MALFORMED_COMMAND, "redis_commandv_append expects a non-empty array!", program, returnValue);
+			return;
+		}
+
+		// Append command to be invoked...
+		appendRedisCommand(program, returnValue, _argv.size(), &_argv[0], &_argvlen[0], true);
+	}
+
+	/**
+	 * -----------------------------------------
+	 * redis_command_nowait
+	 * -----------------------------------------
+	 */
+	MV_EL_FunctionParameter redis_command_nowait_parameters[] = {
+		{"command", 7, EPF_NORMAL},
+		{"args", 4, EPF_NORMAL}};
+	void redis_command_nowait(mvProgram program, mvVariableHash parameters, mvVariable returnValue, void **pdata)
+	{
+		if (!isRedisEnabled(program, returnValue))
+		{
+			mvVariable_SetValue_Integer(returnValue, 0);
+			return;
+		}
+
+		if (_connection == NULL)
+		{
+			setRedisError(ERROR_NOT_CONNECTED, "Not connected! Use redis_connect!", program, returnValue);
+			return;
+		}
+
+		int commandLength = 0;
+		const char *command = mvVariable_Value(mvVariableHash_Index(parameters, 0), &commandLength);
+
+		int argsLength = 0;
+		const char *args = mvVariable_Value(mvVariableHash_Index(parameters, 1), &argsLength);
+
+		RedisCommandTemplate *commandTemplate = getRedisCommandTemplate(program, returnValue, command, commandLength, args, argsLength);
+		if (commandTemplate == NULL)
+			return;
+
+		buildRedisArgv(program, commandTemplate);
+
+		bool appended = appendRedisCommand(program, returnValue, _argv.size(), &_argv[0], &_argvlen[0], false);
+		releaseRedisCommandTemplate(commandTemplate);
+
+		if (appended)
+			mvVariable_SetValue_Integer(returnValue, 1);
+	}
+
+	/**
+	 * -----------------------------------------
+	 * redis_commandv_nowait
+	 * -----------------------------------------
+	 */
+	MV_EL_FunctionParameter redis_commandv_nowait_parameters[] = {
+		{"command", 7, EPF_REFERENCE}};
+	void redis_commandv_nowait(mvProgram program, mvVariableHash parameters, mvVariable returnValue, void **pdata)
+	{
+		if (!isRedisEnabled(program, returnValue))
+		{
+			mvVariable_SetValue_Integer(returnValue, 0);
+			return;
+		}
+
+		if (_connection == NULL)
+		{
+			setRedisError(ERROR_NOT_CONNECTED, "Not connected! Use redis_connect!", program, returnValue);
+			return;
+		}
+
+		if (!buildRedisArgvFromArray(mvVariableHash_Index(parameters, 0)))
+		{
+			setRedisError(ERROR_MALFORMED_COMMAND, "redis_commandv_nowait expects a non-empty array!", program, returnValue);
+			return;
+		}
+
+		if (appendRedisCommand(program, returnValue, _argv.size(), &_argv[0], &_argvlen[0], false))
+			mvVariable_SetValue_Integer(returnValue, 1);
+	}
+
+	/**
+	 * -----------------------------------------
+	 * redis_flush
+	 * -----------------------------------------
+	 */
+	MV_EL_FunctionParameter redis_flush_parameters[] = {};
+	void redis_flush(mvProgram program, mvVariableHash parameters, mvVariable returnValue, void **pdata)
+	{
+		if (!isRedisEnabled(program, returnValue))
+		{
+			mvVariable_SetValue_Integer(returnValue, 0);
+			return;
+		}
+
+		if (_connection == NULL)
+		{
+			setRedisError(ERROR_NOT_CONNECTED, "Not connected! Use redis_connect!", program, returnValue);
+			return;
+		}
+
+		vector<RedisEndpoint *> servers = getRedisTargetServers();
+		for (size_t i = 0; i < servers.size(); i++)
+		{
+			if (servers[i]->context == NULL)
+				continue;
+
+			if (!flushRedisPipeline(servers[i]) || !awaitRedisReplies(servers[i]))
+			{
+				_endpoint = servers[i];
+				setRedisConnectionError(program, returnValue);
+				return;
+			}
+		}
+
+		mvVariable_SetValue_Integer(returnValue, 1);
+	}
+
+	/**
+	 * -----------------------------------------
+	 * redis_get_reply
+	 * -----------------------------------------
+	 */
+	MV_EL_FunctionParameter redis_get_reply_parameters[] = {
+		{"reply", 5, EPF_REFERENCE}};
+	void redis_get_reply(mvProgram program, mvVariableHash parameters, mvVariable returnValue, void **pdata)
+	{
+		if (!isRedisEnabled(program, returnValue))
+		{
+			mvVariable_SetValue_Integer(returnValue, 0);
+			return;
+		}
+
+		if (_connection == NULL)
+		{
+			setRedisError(ERROR_NOT_CONNECTED, "Not connected! Use redis_connect!", program, returnValue);
+			return;
+		}
+
+		RedisEndpoint *endpoint = _endpoint;
+		redisReply *reply = NULL;
+		do
+		{
+			// The replies of a target with several servers are spread over them, take them in the order the commands were sent
+			if (!_target->nodes.empty())
+			{
+				if (_target->replyOrder.empty())
+				{
+					mvVariable_SetValue_Integer(returnValue, 0);
+					return;
+				}
+
+				endpoint = _target->replyOrder.front();
+				_target->replyOrder.pop_front();
+			}
+
+			// Read until the next reply the script asked for, discarding nowait replies on the way
+			while (endpoint->replies.empty() && endpoint->wantedReplies > 0)
+			{
+				redisReply *next;
+				if (redisGetReply(endpoint->context, (void **)&next) != REDIS_OK)
+				{
+					_endpoint = endpoint;
+					setRedisConnectionError(program, returnValue);
+					return;
+				}
+
+				queueRedisReply(endpoint, next);
+			}
+
+			if (endpoint->replies.empty() && _target->nodes.empty())
+			{
+				mvVariable_SetValue_Integer(returnValue, 0);
+				return;
+			}
+
+			// Replies a node dropped leave a gap, skip it
+			if (!endpoint->replies.empty())
+			{
+				reply = endpoint->replies.front();
+				endpoint->replies.pop_front();
+			}
+		} while (reply == NULL);
+
+		returnRedisReply(reply, mvVariableHash_Index(parameters, 0));
+		freeReplyObject(reply);
+
+		if (!_target->nodes.empty())
+			mvVariable_SetValue_Integer(returnValue, _target->replyOrder.size() + 1);
+		else
+			mvVariable_SetValue_Integer(returnValue, endpoint->replies.size() + endpoint->wantedReplies + 1);
+	}
+
+	/**
+	 * -----------------------------------------
+	 * redis_pipeline_dropped
+	 * -----------------------------------------
+	 */
+	MV_EL_FunctionParameter redis_pipeline_dropped_parameters[] = {};
+	void redis_pipeline_dropped(mvProgram program, mvVariableHash parameters, mvVariable returnValue, void **pdata)
+	{
+		if (!isRedisEnabled(program, returnValue))
+		{
+			mvVariable_SetValue_Integer(returnValue, 0);
+			return;
+		}
+
+		int droppedReplies = 0;
+		vector<RedisEndpoint *> servers = getRedisTargetServers();
+		for (size_t i = 0; i < servers.size(); i++)
+		{
+			droppedReplies += servers[i]->droppedReplies;
+			servers[i]->droppedReplies = 0;
+		}
+
+		mvVariable_SetValue_Integer(returnValue, droppedReplies);
+	}
+
+	/**
+	 * -----------------------------------------
+	 * Redis Command: GET
+	 * -----------------------------------------
+	 */
+	MV_EL_FunctionParameter redis_get_parameters[] = {{"key", 3, EPF_NORMAL}, {"ret", 3, EPF_REFERENCE}};
+	void redis_get(mvProgram program, mvVariableHash parameters, mvVariable returnValue, void **pdata)
+	{
+		if (!isRedisEnabled(program, returnValue))
+		{
+			mvVariable_SetValue_Integer(returnValue, 0);
+			return;
+		}
+
+		if (_connection == NULL)
+		{
+			setRedisError(ERROR_NOT_CONNECTED, "Not connected! Use redis_connect!", program, returnValue);
+			return;
+		}
+
+		int keyLength = 0;
+		const char *key = mvVariable_Value(mvVariableHash_Index(parameters, 0), &keyLength);
+		mvVariable ret = mvVariableHash_Index(parameters, 1);
+
+		if (!routeRedisKey(program, returnValue, key, keyLength, true))
+			return;
+
+		const string *cached = findRedisCacheEntry(_endpoint, key, keyLength);
+		if (cached != NULL)
+		{
+			mvVariable_SetValue(ret, cached->data(), cached->size());
+			mvVariable_SetValue_Integer(returnValue, 1);
+			return;
+		}
+
+		size_t sharedLength;
+		char *shared = findSharedCacheEntry(_endpoint, key, keyLength, &sharedLength);
+		if (shared != NULL)
+		{
+			mvVariable_SetValue_Nocopy(ret, shared, sharedLength, sharedLength + 1);
+			mvVariable_SetValue_Integer(returnValue, 1);
+			return;
+		}
+
+		const char *argv[] = {"GET", key};
+		const size_t argvlen[] = {3, (size_t)keyLength};
+		redisReply *reply = runRedisCommand(program, returnValue, 2, argv, argvlen);
+		if (reply == NULL)
+			return;
+
+		if (reply->type == REDIS_REPLY_NIL)
+		{
+			mvVariable_SetValue_Integer(returnValue, -1);
+			freeReplyObject(reply);
+			return;
+		}
+
+		if (reply->type != REDIS_REPLY_STRING)
+		{
+			setRedisError(ERROR_COMMAND, "Redis did not return with the proper type REDIS_REPLY_STRING", program, returnValue);
+			freeReplyObject(reply);
+			return;
+		}
+
+		if (!moveRedisReplyValue(reply, ret))
+		{
+			setRedisError(ERROR_MALFORMED_VALUE, "Compressed value is corrupt!", program, returnValue);
+			freeReplyObject(reply);
+			return;
+		}
+
+		int valueLength = 0;
+		const char *value = mvVariable_Value(ret, &valueLength);
+		storeRedisCacheEntry(_endpoint, key, keyLength, value, valueLength);
+		storeSharedCacheEntry(_endpoint, key, keyLength, value, valueLength);
+
+		mvVariable_SetValue_Integer(returnValue, 1);
+
+		freeReplyObject(reply);
+	}
+
+	/**
+	 * -----------------------------------------
+	 * Redis Command: GET, written to the response
+	 * -----------------------------------------
+	 */
+	MV_EL_FunctionParameter redis_get_output_parameters[] = {{"key", 3, EPF_NORMAL}};
+	void redis_get_output(mvProgram program, mvVariableHash parameters, mvVariable returnValue, void **pdata)
+	{
+		if (!isRedisEnabled(program, returnValue))
+		{
+			mvVariable_SetValue_Integer(returnValue, 0);
+			return;
+		}
+
+		if (_connection == NULL)
+		{
+			setRedisError(ERROR_NOT_CONNECTED, "Not connected! Use redis_connect!", program, returnValue);
+			return;
+		}
+
+		int keyLength = 0;
+		const char *key = mvVariable_Value(mvVariableHash_Index(parameters, 0), &keyLength);
+
+		if (!routeRedisKey(program, returnValue, key, keyLength, true))
+			return;
+
+		const string *cached = findRedisCacheEntry(_endpoint, key, keyLength);
+		if (cached != NULL)
+		{
+			mvProgram_Output(program, cached->data(), cached->size());
+			mvVariable_SetValue_Integer(returnValue, 1);
+			return;
+		}
+
+		size_t sharedLength;
+		char *shared = findSharedCacheEntry(_endpoint, key, keyLength, &sharedLength);
+		if (shared != NULL)
+		{
+			mvProgram_Output(program, shared, sharedLength);
+			free(shared);
+			mvVariable_SetValue_Integer(returnValue, 1);
+			return;
+		}
+
+		int result = streamRedisValue(program, returnValue, key, keyLength);
+		if (result != 0)
+			mvVariable_SetValue_Integer(returnValue, result);
+	}
+
+	/**
+	 * -----------------------------------------
+	 * Redis Command: DEL
+	 * -----------------------------------------
+	 */
+	MV_EL_FunctionParameter redis_del_parameters[] = {{"key", 3, EPF_NORMAL}};
+	void redis_del(mvProgram program, mvVariableHash parameters, mvVariable returnValue, void **pdata)
+	{
+		if (!isRedisEnabled(program, returnValue))
+		{
+			mvVariable_SetValue_Integer(returnValue, 0);
+			return;
+		}
+
+		if (_connection == NULL)
+		{
+			setRedisError(ERROR_NOT_CONNECTED, "Not connected! Use redis_connect!", program, returnValue);
+			return;
+		}
+
+		mvVariable keys = mvVariableHash_Index(parameters, 0);
+
+		_argv.assign(1, "DEL");
+		_argvlen.assign(1, 3);
+
+		if (mvVariable_Aggregate_Type(keys) == MVA_ARRAY)
+		{
+			appendRedisArgvFromArray(keys, NULL);
+		}
+		else
+		{
+			int keyLength = 0;
+			_argv.push_back(mvVariable_Value(keys, &keyLength));
+			_argvlen.push_back(keyLength);
+		}
+
+		for (size_t i = 1; i < _argv.size(); i++)
+			forgetRedisCacheEntry(findRedisKeyEndpoint(_argv[i], _argvlen[i]), _argv[i], _argvlen[i]);
+
+		if (_argv.size() == 1)
+		{
+			mvVariable_SetValue_Integer(returnValue, 1);
+			return;
+		}
+
+		redisReply *reply = runRedisCommand(program, returnValue, _argv.size(), &_argv[0], &_argvlen[0]);
+		if (reply == NULL)
+			return;
+
+		freeReplyObject(reply);
+		mvVariable_SetValue_Integer(returnValue, 1);
+	}
+
+	/**
+	 * -----------------------------------------
+	 * Redis Command: MGET
+	 * -----------------------------------------
+	 */
+	MV_EL_FunctionParameter redis_mget_parameters[] = {{"keys", 4, EPF_REFERENCE}, {"values", 6, EPF_REFERENCE}, {"hits", 4, EPF_REFERENCE}};
+	void redis_mget(mvProgram program, mvVariableHash parameters, mvVariable returnValue, void **pdata)
+	{
+		if (!isRedisEnabled(program, returnValue))
+		{
+			mvVariable_SetValue_Integer(returnValue, 0);
+			return;
+		}
+
+		if (_connection == NULL)
+		{
+			setRedisError(ERROR_NOT_CONNECTED, "Not connected! Use redis_connect!", program, returnValue);
+			return;
+		}
+
+		mvVariable keys = mvVariableHash_Index(parameters, 0);
+		mvVariable values = mvVariableHash_Index(parameters, 1);
+		mvVariable hits = mvVariableHash_Index(parameters, 2);
+
+		mvVariable_SetValue(values, "", 0);
+		mvVariable_SetValue(hits, "", 0);
+
+		_argv.assign(1, "MGET");
+		_argvlen.assign(1, 4);
+
+		vector<int> indexes;
+		if (mvVariable_Aggregate_Type(keys) == MVA_ARRAY)
+			appendRedisArgvFromArray(keys, &indexes);
+
+		if (indexes.size() == 0)
+		{
+			mvVariable_SetValue_Integer(returnValue, 1);
+			return;
+		}
+
+		redisReply *reply = runRedisCommand(program, returnValue, _argv.size(), &_argv[0], &_argvlen[0]);
+		if (reply == NULL)
+			return;
+
+		if (reply->type != REDIS_REPLY_ARRAY || reply->elements != indexes.size())
+		{
+			setRedisError(ERROR_COMMAND, "Redis did not return with the proper type REDIS_REPLY_ARRAY", program, returnValue);
+			freeReplyObject(reply);
+			return;
+		}
+
+		// values only gets an element for keys that were found, hits says which ones those were.
+		// A corrupt compressed value counts as a miss.
+		for (size_t i = 0; i < reply->elements; i++)
+		{
+			redisReply *element = reply->element[i];
+			bool hit = element->type == REDIS_REPLY_STRING;
+
+			if (hit)
+			{
+				mvVariable valueVar = mvVariable_Allocate("value", 5, "", 0);
+				hit = moveRedisReplyValue(element, valueVar);
+				if (hit)
+					mvVariable_Set_Array_Element(indexes[i], valueVar, values);
+				else
+					mvVariable_Free(valueVar);
+			}
+
+			mvVariable hitVar = mvVariable_Allocate("hit", 3, "", 0);
+			mvVariable_SetValue_Integer(hitVar, hit);
+			mvVariable_Set_Array_Element(indexes[i], hitVar, hits);
+		}
+
+		freeReplyObject(reply);
+		mvVariable_SetValue_Integer(returnValue, 1);
+	}
+
+	/**
+	 * -----------------------------------------
+	 * Redis Command: MSET
+	 * -----------------------------------------
+	 */
+	MV_EL_FunctionParameter redis_mset_parameters[] = {{"values", 6, EPF_REFERENCE}};
+	void redis_mset(mvProgram program, mvVariableHash parameters, mvVariable returnValue, void **pdata)
+	{
+		if (!isRedisEnabled(program, returnValue))
+		{
+			mvVariable_SetValue_Integer(returnValue, 0);
+			return;
+		}
+
+		if (_connection == NULL)
+		{
+			setRedisError(ERROR_NOT_CONNECTED, "Not connected! Use redis_connect!", program, returnValue);
+			return;
+		}
+
+		mvVariable values = mvVariableHash_Index(parameters, 0);
+		if (mvVariable_Aggregate_Type(values) != MVA_STRUCT)
+		{
+			setRedisError(ERROR_MALFORMED_COMMAND, "redis_mset expects a structure of key/value pairs!", program, returnValue);
+			return;
+		}
+
+		_argv.assign(1, "MSET");
+		_argvlen.assign(1, 4);
+
+		mvVariableList members = mvVariableList_Allocate();
+		mvVariable_Aggregate_List(values, members);
+
+		// A deque so compressed values already in _argv don't move as more are added
+		deque<string> compressed;
+
+		for (mvVariable member = mvVariableList_First(members); member != NULL; member = mvVariableList_Next(members))
+		{
+			int nameLength = 0, valueLength = 0;
+			_argv.push_back(mvVariable_Name(member, &nameLength));
+			_argvlen.push_back(nameLength);
+			forgetRedisCacheEntry(findRedisKeyEndpoint(_argv.back(), nameLength), _argv.back(), nameLength);
+
+			const char *value = mvVariable_Value(member, &valueLength);
+			compressed.push_back(string());
+			if (compressRedisValue(value, valueLength, compressed.back()))
+			{
+				_argv.push_back(compressed.back().data());
+				_argvlen.push_back(compressed.back().size());
+			}
+			else
+			{
+				_argv.push_back(value);
+				_argvlen.push_back(valueLength);
+			}
+		}
+
+		if (_argv.size() == 1)
+		{
+			mvVariableList_Free(members);
+			mvVariable_SetValue_Integer(returnValue, 1);
+			return;
+		}
+
+		// The member names and values are only valid while the list is
+		redisReply *reply = runRedisCommand(program, returnValue, _argv.size(), &_argv[0], &_argvlen[0]);
+		mvVariableList_Free(members);
+
+		if (reply == NULL)
+			return;
+
+		freeReplyObject(reply);
+		mvVariable_SetValue_Integer(returnValue, 1);
+	}
+
+	/**
+	 * -----------------------------------------
+	 * Redis Command: HSET (from a structure)
+	 * -----------------------------------------
+	 */
+	MV_EL_FunctionParameter redis_hset_struct_parameters[] = {{"key", 3, EPF_NORMAL}, {"value", 5, EPF_REFERENCE}, {"fields", 6, EPF_NORMAL}};
+	void redis_hset_struct(mvProgram program, mvVariableHash parameters, mvVariable returnValue, void **pdata)
+	{
+		if (!isRedisEnabled(program, returnValue))
+		{
+			mvVariable_SetValue_Integer(returnValue, 0);
+			return;
+		}
+
+		if (_connection == NULL)
+		{
+			setRedisError(ERROR_NOT_CONNECTED, "Not connected! Use redis_connect!", program, returnValue);
+			return;
+		}
+
+		int keyLength = 0;
+		const char *key = mvVariable_Value(mvVariableHash_Index(parameters, 0), &keyLength);
+
+		mvVariable value = mvVariableHash_Index(parameters, 1);
+		if (mvVariable_Aggregate_Type(value) != MVA_STRUCT)
+		{
+			setRedisError(ERROR_MALFORMED_COMMAND, "redis_hset_struct expects a structure!", program, returnValue);
+			return;
+		}
+
+		int fieldsLength = 0;
+		const char *fields = mvVariable_Value(mvVariableHash_Index(parameters, 2), &fieldsLength);
+
+		_argv.assign(1, "HSET");
+		_argvlen.assign(1, 4);
+		_argv.push_back(key);
+		_argvlen.push_back(keyLength);
+
+		// Either every member, or just the listed ones that exist
+		mvVariableList members = mvVariableList_Allocate();
+		vector<string> fieldNames;
+		if (fieldsLength == 0)
+		{
+			mvVariable_Aggregate_List(value, members);
+
+			for (mvVariable member = mvVariableList_First(members); member != NULL; member = mvVariableList_Next(members))
+			{
+				int nameLength = 0, valueLength = 0;
+				_argv.push_back(mvVariable_Name(member, &nameLength));
+				_argvlen.push_back(nameLength);
+				_argv.push_back(mvVariable_Value(member, &valueLength));
+				_argvlen.push_back(valueLength);
+			}
+		}
+		else
+		{
+			splitRedisNames(fields, fieldsLength, fieldNames);
+
+			for (size_t i = 0; i < fieldNames.size(); i++)
+			{
+				mvVariable member = mvVariable_Struct_Member(fieldNames[i].data(), fieldNames[i].size(), value, 0);
+				if (member == NULL)
+					continue;
+
+				int valueLength = 0;
+				_argv.push_back(fieldNames[i].data());
+				_argvlen.push_back(fieldNames[i].size());
+				_argv.push_back(mvVariable_Value(member, &valueLength));
+				_argvlen.push_back(valueLength);
+			}
+		}
+
+		if (_argv.size() == 2)
+		{
+			mvVariableList_Free(members);
+			mvVariable_SetValue_Integer(returnValue, 1);
+			return;
+		}
+
+		redisReply *reply = runRedisCommand(program, returnValue, _argv.size(), &_argv[0], &_argvlen[0]);
+		mvVariableList_Free(members);
+
+		if (reply == NULL)
+			return;
+
+		freeReplyObject(reply);
+		mvVariable_SetValue_Integer(returnValue, 1);
+	}
+
+	/**
+	 * -----------------------------------------
+	 * Redis Command: HGETALL/HMGET (into a structure)
+	 * -----------------------------------------
+	 */
+	MV_EL_FunctionParameter redis_hget_struct_parameters[] = {{"key", 3, EPF_NORMAL}, {"ret", 3, EPF_REFERENCE}, {"fields", 6, EPF_NORMAL}};
+	void redis_hget_struct(mvProgram program, mvVariableHash parameters, mvVariable returnValue, void **pdata)
+	{
+		if (!isRedisEnabled(program, returnValue))
+		{
+			mvVariable_SetValue_Integer(returnValue, 0);
+			return;
+		}
+
+		if (_connection == NULL)
+		{
+			setRedisError(ERROR_NOT_CONNECTED, "Not connected! Use redis_connect!", program, returnValue);
+			return;
+		}
+
+		int keyLength = 0;
+		const char *key = mvVariable_Value(mvVariableHash_Index(parameters, 0), &keyLength);
+
+		mvVariable ret = mvVariableHash_Index(parameters, 1);
+
+		int fieldsLength = 0;
+		const char *fields = mvVariable_Value(mvVariableHash_Index(parameters, 2), &fieldsLength);
+
+		vector<string> fieldNames;
+		splitRedisNames(fields, fieldsLength, fieldNames);
+
+		_argv.assign(1, fieldNames.size() == 0 ? "HGETALL" : "HMGET");
+		_argvlen.assign(1, fieldNames.size() == 0 ? 7 : 5);
+		_argv.push_back(key);
+		_argvlen.push_back(keyLength);
+
+		for (size_t i = 0; i < fieldNames.size(); i++)
+		{
+			_argv.push_back(fieldNames[i].data());
+			_argvlen.push_back(fieldNames[i].size());
+		}
+
+		redisReply *reply = runRedisCommand(program, returnValue, _argv.size(), &_argv[0], &_argvlen[0]);
+		if (reply == NULL)
+			return;
+
+		if (reply->type != REDIS_REPLY_ARRAY)
+		{
+			setRedisError(ERROR_COMMAND, "Redis did not return with the proper type REDIS_REPLY_ARRAY", program, returnValue);
+			freeReplyObject(reply);
+			return;
+		}
+
+		// A full read replaces the structure, a partial read only sets the fields that exist
+		if (fieldNames.size() == 0)
+			mvVariable_SetValue(ret, "", 0);
+
+		int found = 0;
+		for (size_t i = 0; i < reply->elements; i++)
+		{
+			redisReply *name, *value;
+			if (fieldNames.size() == 0)
+			{
+				name = reply->element[i++];
+				value = i < reply->elements ? reply->element[i] : NULL;
+				if (value == NULL || name->type != REDIS_REPLY_STRING)
+					break;
+			}
+			else
+			{
+				name = NULL;
+				value = reply->element[i];
+			}
+
+			if (value->type != REDIS_REPLY_STRING)
+				continue;
+
+			const char *memberName = name ? name->str : fieldNames[i].data();
+			int memberNameLength = name ? name->len : fieldNames[i].size();
+
+			mvVariable memberVar = mvVariable_Allocate(memberName, memberNameLength, "", 0);
+			moveRedisReplyString(value, memberVar);
+			mvVariable_Set_Struct_Member(memberName, memberNameLength, memberVar, ret);
+			found++;
+		}
+
+		freeReplyObject(reply);
+		mvVariable_SetValue_Integer(returnValue, found > 0 ? 1 : -1);
+	}
+
+	/**
+	 * -----------------------------------------
+	 * Redis Command: SET (any variable)
+	 * -----------------------------------------
+	 */
+	MV_EL_FunctionParameter redis_set_var_parameters[] = {{"key", 3, EPF_NORMAL}, {"value", 5, EPF_REFERENCE}, {"expires", 7, EPF_NORMAL}};
+	void redis_set_var(mvProgram program, mvVariableHash parameters, mvVariable returnValue, void **pdata)
+	{
+		if (!isRedisEnabled(program, returnValue))
+		{
+			mvVariable_SetValue_Integer(returnValue, 0);
+			return;
+		}
+
+		if (_connection == NULL)
+		{
+			setRedisError(ERROR_NOT_CONNECTED, "Not connected! Use redis_connect!", program, returnValue);
+			return;
+		}
+
+		int keyLength = 0;
+		const char *key = mvVariable_Value(mvVariableHash_Index(parameters, 0), &keyLength);
+		int expires = mvVariable_Value_Integer(mvVariableHash_Index(parameters, 2));
+
+		if (setRedisVar(program, returnValue, key, keyLength, mvVariableHash_Index(parameters, 1), expires))
+			mvVariable_SetValue_Integer(returnValue, 1);
+	}
+
+	/**
+	 * -----------------------------------------
+	 * Redis Command: GET (any variable)
+	 * -----------------------------------------
+	 */
+	MV_EL_FunctionParameter redis_get_var_parameters[] = {{"key", 3, EPF_NORMAL}, {"ret", 3, EPF_REFERENCE}};
+	void redis_get_var(mvProgram program, mvVariableHash parameters, mvVariable returnValue, void **pdata)
+	{
+		if (!isRedisEnabled(program, returnValue))
+		{
+			mvVariable_SetValue_Integer(returnValue, 0);
+			return;
+		}
+
+		if (_connection == NULL)
+		{
+			setRedisError(ERROR_NOT_CONNECTED, "Not connected! Use redis_connect!", program, returnValue);
+			return;
+		}
+
+		int keyLength = 0;
+		const char *key = mvVariable_Value(mvVariableHash_Index(parameters, 0), &keyLength);
+
+		int found = getRedisVar(program, returnValue, key, keyLength, mvVariableHash_Index(parameters, 1));
+		if (found != 0)
+			mvVariable_SetValue_Integer(returnValue, found);
+	}
+
+	/**
+	 * -----------------------------------------
+	 * Cache-aside fetch with stampede protection
+	 * -----------------------------------------
+	 */
+	MV_EL_FunctionParameter redis_cache_fetch_parameters[] = {{"key", 3, EPF_NORMAL}, {"ttl", 3, EPF_NORMAL}, {"function_name", 13, EPF_NORMAL}, {"result", 6, EPF_REFERENCE}};
+	void redis_cache_fetch(mvProgram program, mvVariableHash parameters, mvVariable returnValue, void **pdata)
+	{
+		if (!isRedisEnabled(program, returnValue))
+		{
+			mvVariable_SetValue_Integer(returnValue, 0);
+			return;
+		}
+
+		if (_connection == NULL)
+		{
+			setRedisError(ERROR_NOT_CONNECTED, "Not connected! Use redis_connect!", program, returnValue);
+			return;
+		}
+
+		// Copied, the function may call back into redis_* and reuse the scratch buffers
+		int keyLength = 0, functionLength = 0;
+		const char *keyValue = mvVariable_Value(mvVariableHash_Index(parameters, 0), &keyLength);
+		string key(keyValue, keyLength);
+		const char *functionValue = mvVariable_Value(mvVariableHash_Index(parameters, 2), &functionLength);
+		string function(functionValue, functionLength);
+
+		int ttl = mvVariable_Value_Integer(mvVariableHash_Index(parameters, 1));
+		mvVariable result = mvVariableHash_Index(parameters, 3);
+
+		if (ttl <= 0 || function.size() == 0)
+		{
+			setRedisError(ERROR_MALFORMED_COMMAND, "redis_cache_fetch needs a ttl and a function name!", program, returnValue);
+			return;
+		}
+
+		int64_t freshUntil = 0;
+		int32_t computeTime = 0;
+		int found = readRedisCacheFetchValue(program, returnValue, key, result, &freshUntil, &computeTime);
+		if (found < 0)
+			return;
+
+		if (found && !isRedisCacheFetchDue(freshUntil, computeTime))
+		{
+			mvVariable_SetValue_Integer(returnValue, 1);
+			return;
+		}
+
+		int cacheLockTimeout = _persistent->options.cacheLockTimeout;
+		int cacheStaleTtl = _persistent->options.cacheStaleTtl;
+
+		RedisCacheFetchLock lock;
+		lock.program = program;
+		lock.key = key + ":lock";
+		lock.held = false;
+
+		int locked = lockRedisCacheFetch(program, returnValue, lock.key, lock.token);
+		if (locked < 0)
+			return;
+
+		lock.held = locked > 0;
+
+		// Another worker is rebuilding: serve the stale copy, or wait for the new one
+		if (!locked && found)
+		{
+			mvVariable_SetValue_Integer(returnValue, 1);
+			return;
+		}
+
+		for (int waited = 0; !locked && waited < cacheLockTimeout; waited += CACHE_FETCH_POLL_MILLIS)
+		{
+			mvProgram_Sleep(program, CACHE_FETCH_POLL_MILLIS);
+
+			found = readRedisCacheFetchValue(program, returnValue, key, result, &freshUntil, &computeTime);
+			if (found != 0)
+			{
+				if (found > 0)
+					mvVariable_SetValue_Integer(returnValue, 1);
+
+				return;
+			}
+		}
+
+		string target = _target->name;
+
+		mvVariableList functionParameters = mvVariableList_Allocate();
+		mvVariable functionResult = mvVariable_Allocate("result", 6, "", 0);
+
+		int64_t started = currentTimeMillis();
+		int ran = mvProgram_RunFunction(program, function.data(), function.size(), functionParameters, functionResult);
+		computeTime = (int32_t)(currentTimeMillis() - started);
+
+		mvVariableList_Free(functionParameters);
+
+		// Without its target the lock can't be released, it expires after cache_lock_timeout
+		bool restored = restoreRedisTarget(program, returnValue, target);
+		lock.held = lock.held && restored;
+
+		if (!ran)
+		{
+			mvVariable_Free(functionResult);
+			setRedisError(ERROR_MALFORMED_COMMAND, "redis_cache_fetch could not run " + function + "!", program, returnValue);
+			return;
+		}
+
+		// Hand the result over even if it can't be cached
+		_encodeBuffer.assign(CACHE_FETCH_MAGIC, CACHE_FETCH_MAGIC_LENGTH);
+		freshUntil = wallTimeMillis() + (int64_t)ttl * 1000;
+		_encodeBuffer.append((const char *)&freshUntil, sizeof(freshUntil));
+		_encodeBuffer.append((const char *)&computeTime, sizeof(computeTime));
+		_encodeBuffer.append(VAR_CODEC_MAGIC, VAR_CODEC_MAGIC_LENGTH);
+		encodeRedisVariable(_encodeBuffer, functionResult);
+		mvVariable_Free(functionResult);
+
+		size_t headerLength = CACHE_FETCH_MAGIC_LENGTH + sizeof(freshUntil) + sizeof(computeTime);
+		decodeRedisVarValue(program, returnValue, _encodeBuffer.data() + headerLength, _encodeBuffer.size() - headerLength, result);
+
+		if (!restored)
+		{
+			mvVariable_SetValue_Integer(returnValue, 0);
+			return;
+		}
+
+		if (compressRedisValue(_encodeBuffer.data(), _encodeBuffer.size(), _compressBuffer))
+			_encodeBuffer.swap(_compressBuffer);
+
+		// Kept past its ttl so a stale copy can be served while it is rebuilt
+		char expires[24];
+		int expiresLength = snprintf(expires, sizeof(expires), "%lld", (long long)ttl * 1000 + (cacheStaleTtl > 0 ? cacheStaleTtl : 0));
+
+		forgetRedisCacheEntry(findRedisKeyEndpoint(key.data(), key.size()), key.data(), key.size());
+
+		const char *argv[] = {"SET", key.data(), _encodeBuffer.data(), "PX", expires};
+		const size_t argvlen[] = {3, key.size(), _encodeBuffer.size(), 2, (size_t)expiresLength};
+		redisReply *reply = runRedisCommand(program, returnValue, 5, argv, argvlen);
+		if (reply == NULL)
+			return;
+
+		freeReplyObject(reply);
+		mvVariable_SetValue_Integer(returnValue, 2);
+	}
+
+	/**
+	 * -----------------------------------------
+	 * Memoized function call
+	 * -----------------------------------------
+	 */
+	MV_EL_FunctionParameter redis_memoize_parameters[] = {{"function_name", 13, EPF_NORMAL}, {"params", 6, EPF_REFERENCE}, {"ttl", 3, EPF_NORMAL}, {"result", 6, EPF_REFERENCE}};
+	void redis_memoize(mvProgram program, mvVariableHash parameters, mvVariable returnValue, void **pdata)
+	{
+		if (!isRedisEnabled(program, returnValue))
+		{
+			mvVariable_SetValue_Integer(returnValue, 0);
+			return;
+		}
+
+		if (_connection == NULL)
+		{
+			setRedisError(ERROR_NOT_CONNECTED, "Not connected! Use redis_connect!", program, returnValue);
+			return;
+		}
+
+		// Function names are case insensitive, so is the key
+		int functionLength = 0;
+		const char *functionValue = mvVariable_Value(mvVariableHash_Index(parameters, 0), &functionLength);
+		string function(functionValue, functionLength);
+		for (size_t i = 0; i < function.size(); i++)
+			function[i] = tolower((unsigned char)function[i]);
+
+		mvVariable params = mvVariableHash_Index(parameters, 1);
+		int ttl = mvVariable_Value_Integer(mvVariableHash_Index(parameters, 2));
+		mvVariable result = mvVariableHash_Index(parameters, 3);
+
+		// Results that never expire would pile up for every set of arguments ever seen
+		if (ttl <= 0 || function.size() == 0)
+		{
+			setRedisError(ERROR_MALFORMED_COMMAND, "redis_memoize needs a ttl and a function name!", program, returnValue);
+			return;
+		}
+
+		// memoize:<function>:<128 bit hash of the encoded parameters>
+		string encoded;
+		encodeRedisVariable(encoded, params);
+
+		uint64_t seed = hashSharedCacheKey(14695981039346656037ull, function.data(), function.size());
+		char hash[33];
+		snprintf(hash, sizeof(hash), "%016llx%016llx",
+				 (unsigned long long)hashSharedCacheKey(seed, encoded.data(), encoded.size()),
+				 (unsigned long long)hashSharedCacheKey(seed ^ 0x9e3779b97f4a7c15ull, encoded.data(), encoded.size()));
+
+		string key = "memoize:" + function + ":" + hash;
+
+		int found = getRedisVar(program, returnValue, key.data(), key.size(), result);
+		if (found == 0)
+			return;
+
+		if (found > 0)
+		{
+			mvVariable_SetValue_Integer(returnValue, 1);
+			return;
+		}
+
+		// An array holds the arguments in order, anything else that isn't empty is the only one.
+		// They are copies, so the function can't change the caller's variables.
+		vector<mvVariable> arguments;
+		int paramsLength = 0;
+		mvVariable_Value(params, &paramsLength);
+
+		if (mvVariable_Aggregate_Type(params) == MVA_ARRAY)
+		{
+			int last = mvVariable_Array_Max(params);
+			for (int index = 1; index <= last; index++)
+			{
+				mvVariable argument = mvVariable_Allocate("param", 5, "", 0);
+				mvVariable element = mvVariable_Array_Element(index, params, 0);
+				if (element != NULL)
+					copyRedisVariable(element, argument);
+
+				arguments.push_back(argument);
+			}
+		}
+		else if (mvVariable_Aggregate_Type(params) == MVA_STRUCT || paramsLength > 0)
 		{
-			mvVariable_SetValue(mvVariableHash_Index(parameters, 0), _lastRedisError.c_str(), _lastRedisError.size());
+			mvVariable argument = mvVariable_Allocate("param", 5, "", 0);
+			copyRedisVariable(params, argument);
+			arguments.push_back(argument);
 		}
-	}
 
-	/**
-	 * -----------------------------------------
-	 * redis_clear_error
-	 * -----------------------------------------
-	 */
-	MV_EL_FunctionParameter redis_error_clear_parameters[] = {};
-	void redis_error_clear(mvProgram program, mvVariableHash parameters, mvVariable returnValue, void **pdata)
-	{
-		_lastRedisError = "";
-		_lastRedisErrorCode = 0;
-	}
+		mvVariableList functionParameters = mvVariableList_Allocate();
+		for (size_t i = 0; i < arguments.size(); i++)
+			mvVariableList_Insert(functionParameters, arguments[i]);
 
-	/**
-	 * -----------------------------------------
-	 * redis_free
-	 * -----------------------------------------
-	 */
-	MV_EL_FunctionParameter redis_free_parameters[] = {};
-	void redis_free(mvProgram program, mvVariableHash parameters, mvVariable returnValue, void **pdata)
-	{
-		if (!isRedisEnabled(program, returnValue))
+		string target = _target->name;
+
+		mvVariable functionResult = mvVariable_Allocate("result", 6, "", 0);
+		int ran = mvProgram_RunFunction(program, function.data(), function.size(), functionParameters, functionResult);
+
+		mvVariableList_Free(functionParameters);
+		for (size_t i = 0; i < arguments.size(); i++)
+			mvVariable_Free(arguments[i]);
+
+		bool restored = restoreRedisTarget(program, returnValue, target);
+
+		if (!ran)
 		{
-			mvVariable_SetValue_Integer(returnValue, 0);
+			mvVariable_Free(functionResult);
+			setRedisError(ERROR_MALFORMED_COMMAND, "redis_memoize could not run " + function + "!", program, returnValue);
 			return;
 		}
 
-		if (_connection != NULL)
+		copyRedisVariable(functionResult, result);
+
+		if (!restored)
 		{
-			redisFree(_connection);
-			_connection = NULL;
+			mvVariable_Free(functionResult);
+			mvVariable_SetValue_Integer(returnValue, 0);
+			return;
 		}
 
-		mvVariable_SetValue_Integer(returnValue, 1);
+		bool stored = setRedisVar(program, returnValue, key.data(), key.size(), functionResult, ttl);
+		mvVariable_Free(functionResult);
+
+		if (stored)
+			mvVariable_SetValue_Integer(returnValue, 2);
 	}
 
 	/**
 	 * -----------------------------------------
-	 * redis
+	 * Output cache
 	 * -----------------------------------------
 	 */
-	MV_EL_FunctionParameter redis_command_parameters[] = {
-		{"command", 7, EPF_NORMAL},
-		{"args", 4, EPF_NORMAL}};
-	void redis_command(mvProgram program, mvVariableHash parameters, mvVariable returnValue, void **pdata)
+	MV_EL_FunctionParameter redis_output_cache_begin_parameters[] = {{"key", 3, EPF_NORMAL}, {"ttl", 3, EPF_NORMAL}};
+	void redis_output_cache_begin(mvProgram program, mvVariableHash parameters, mvVariable returnValue, void **pdata)
 	{
+		int keyLength = 0;
+		const char *key = mvVariable_Value(mvVariableHash_Index(parameters, 0), &keyLength);
+
+		// Pushed before anything can fail, so the matching end always pops this call's entry
+		beginRedisRequest(program);
+		_outputCaptures.push_back(RedisOutputCapture());
+		RedisOutputCapture &capture = _outputCaptures.back();
+		capture.ttl = mvVariable_Value_Integer(mvVariableHash_Index(parameters, 1));
+		capture.target = NULL;
+
 		if (!isRedisEnabled(program, returnValue))
 		{
 			mvVariable_SetValue_Integer(returnValue, 0);
@@ -297,53 +5786,139 @@ extern "C"
 			return;
 		}
 
-		int commandLength = 0;
-		const char *command = mvVariable_Value(mvVariableHash_Index(parameters, 0), &commandLength);
-
-		int argsLength = 0;
-		const char *args = mvVariable_Value(mvVariableHash_Index(parameters, 1), &argsLength);
+		if (!routeRedisKey(program, returnValue, key, keyLength, true))
+			return;
 
-		vector<const char *> argv;
-		if (!parseRedisArgs(program, returnValue, command, commandLength, args, argsLength, argv))
+		const string *cached = findRedisCacheEntry(_endpoint, key, keyLength);
+		if (cached != NULL)
 		{
+			_outputCaptures.pop_back();
+			mvProgram_Output(program, cached->data(), cached->size());
+			mvVariable_SetValue_Integer(returnValue, 1);
 			return;
 		}
 
-		if (argv.size() == 0)
+		size_t sharedLength;
+		char *shared = findSharedCacheEntry(_endpoint, key, keyLength, &sharedLength);
+		if (shared != NULL)
 		{
-			setRedisError(ERROR_MALFORMED_COMMAND, "Blank command?!", program, returnValue);
+			_outputCaptures.pop_back();
+			mvProgram_Output(program, shared, sharedLength);
+			free(shared);
+			mvVariable_SetValue_Integer(returnValue, 1);
 			return;
 		}
 
-		// invoke command!
-		redisReply *reply = (redisReply *)redisCommandArgv(_connection, argv.size(), &argv[0], NULL);
-
+		const char *argv[] = {"GET", key};
+		const size_t argvlen[] = {3, (size_t)keyLength};
+		redisReply *reply = runRedisCommand(program, returnValue, 2, argv, argvlen);
 		if (reply == NULL)
+			return;
+
+		if (reply->type == REDIS_REPLY_STRING && isCompressedRedisValue(reply->str, reply->len))
+		{
+			size_t length;
+			char *decompressed = decompressRedisValue(reply->str, reply->len, &length);
+			if (decompressed == NULL)
+			{
+				setRedisError(ERROR_MALFORMED_VALUE, "Compressed value is corrupt!", program, returnValue);
+				freeReplyObject(reply);
+				return;
+			}
+
+			free(reply->str);
+			reply->str = decompressed;
+			reply->len = length;
+		}
+
+		if (reply->type == REDIS_REPLY_STRING)
+		{
+			_outputCaptures.pop_back();
+			mvProgram_Output(program, reply->str, reply->len);
+			storeRedisCacheEntry(_endpoint, key, keyLength, reply->str, reply->len);
+			storeSharedCacheEntry(_endpoint, key, keyLength, reply->str, reply->len);
+			mvVariable_SetValue_Integer(returnValue, 1);
+		}
+		else
+		{
+			// Anything else (normally nil) is a miss, the caller renders and calls end
+			capture.key.assign(key, keyLength);
+			capture.target = _target;
+			mvVariable_SetValue_Integer(returnValue, -1);
+		}
+
+		freeReplyObject(reply);
+	}
+
+	MV_EL_FunctionParameter redis_output_cache_end_parameters[] = {{"content", 7, EPF_REFERENCE}};
+	void redis_output_cache_end(mvProgram program, mvVariableHash parameters, mvVariable returnValue, void **pdata)
+	{
+		int contentLength = 0;
+		const char *content = mvVariable_Value(mvVariableHash_Index(parameters, 0), &contentLength);
+
+		// The page needs the content whether or not it can be cached
+		mvProgram_Output(program, content, contentLength);
+
+		beginRedisRequest(program);
+		if (_outputCaptures.empty())
 		{
-			setRedisError(ERROR_COMMAND, _connection->errstr, program, returnValue);
+			setRedisError(ERROR_MALFORMED_COMMAND, "redis_output_cache_end without redis_output_cache_begin!", program, returnValue);
 			return;
 		}
 
-		if (reply->type == REDIS_REPLY_ERROR)
+		RedisOutputCapture capture = _outputCaptures.back();
+		_outputCaptures.pop_back();
+
+		if (capture.key.size() == 0)
 		{
-			setRedisError(ERROR_COMMAND, reply->str, program, returnValue);
-			freeReplyObject(reply);
+			mvVariable_SetValue_Integer(returnValue, 0);
 			return;
 		}
 
-		formatRedisReply(reply, returnValue);
-		freeReplyObject(reply);
+		// Store on the target begin looked the key up on, even if the page switched targets since
+		RedisEndpoint *target = _target;
+		RedisEndpoint *endpoint = _endpoint;
+		_target = capture.target;
+
+		if (isRedisEnabled(program, returnValue) && _connection != NULL && routeRedisKey(program, returnValue, capture.key.data(), capture.key.size(), false))
+		{
+			forgetRedisCacheEntry(_endpoint, capture.key.data(), capture.key.size());
+
+			if (compressRedisValue(content, contentLength, _compressBuffer))
+			{
+				content = _compressBuffer.data();
+				contentLength = _compressBuffer.size();
+			}
+
+			char expires[16];
+			int expiresLength = snprintf(expires, sizeof(expires), "%d", capture.ttl);
+
+			const char *argv[] = {"SET", capture.key.data(), content, "EX", expires};
+			const size_t argvlen[] = {3, capture.key.size(), (size_t)contentLength, 2, (size_t)expiresLength};
+			redisReply *reply = runRedisCommand(program, returnValue, capture.ttl > 0 ? 5 : 3, argv, argvlen);
+			if (reply != NULL)
+			{
+				freeReplyObject(reply);
+				mvVariable_SetValue_Integer(returnValue, 1);
+			}
+		}
+		else
+		{
+			mvVariable_SetValue_Integer(returnValue, 0);
+		}
+
+		_target = target;
+		_endpoint = endpoint;
+		_connection = endpoint != NULL ? endpoint->context : NULL;
 	}
 
 	/**
 	 * -----------------------------------------
-	 * redis_append
+	 * Redis Command: SET
 	 * -----------------------------------------
 	 */
-	MV_EL_FunctionParameter redis_command_append_parameters[] = {
-		{"command", 7, EPF_NORMAL},
-		{"args", 4, EPF_NORMAL}};
-	void redis_command_append(mvProgram program, mvVariableHash parameters, mvVariable returnValue, void **pdata)
+	MV_EL_FunctionParameter redis_set_parameters[] = {{"key", 3, EPF_NORMAL}, {"value", 5, EPF_REFERENCE}};
+	void redis_set(mvProgram program, mvVariableHash parameters, mvVariable returnValue, void **pdata)
 	{
 		if (!isRedisEnabled(program, returnValue))
 		{
@@ -357,31 +5932,36 @@ extern "C"
 			return;
 		}
 
-		int commandLength = 0;
-		const char *command = mvVariable_Value(mvVariableHash_Index(parameters, 0), &commandLength);
+		int keyLength = 0;
+		const char *key = mvVariable_Value(mvVariableHash_Index(parameters, 0), &keyLength);
+		forgetRedisCacheEntry(findRedisKeyEndpoint(key, keyLength), key, keyLength);
 
-		int argsLength = 0;
-		const char *args = mvVariable_Value(mvVariableHash_Index(parameters, 1), &argsLength);
+		int valueLength = 0;
+		const char *value = mvVariable_Value(mvVariableHash_Index(parameters, 1), &valueLength);
 
-		vector<const char *> argv;
-		if (!parseRedisArgs(program, returnValue, command, commandLength, args, argsLength, argv))
+		if (compressRedisValue(value, valueLength, _compressBuffer))
 		{
-			return;
+			value = _compressBuffer.data();
+			valueLength = _compressBuffer.size();
 		}
 
-		// Append command to be invoked...
-		redisAppendCommandArgv(_connection, argv.size(), &argv[0], NULL);
-		_redisAppendStackSize++;
+		const char *argv[] = {"SET", key, value};
+		const size_t argvlen[] = {3, (size_t)keyLength, (size_t)valueLength};
+		redisReply *reply = runRedisCommand(program, returnValue, 3, argv, argvlen);
+		if (reply == NULL)
+			return;
+
+		freeReplyObject(reply);
+		mvVariable_SetValue_Integer(returnValue, 1);
 	}
 
 	/**
 	 * -----------------------------------------
-	 * redis_get_reply
+	 * Redis Command: APPEND
 	 * -----------------------------------------
 	 */
-	MV_EL_FunctionParameter redis_get_reply_parameters[] = {
-		{"reply", 5, EPF_REFERENCE}};
-	void redis_get_reply(mvProgram program, mvVariableHash parameters, mvVariable returnValue, void **pdata)
+	MV_EL_FunctionParameter redis_append_parameters[] = {{"key", 3, EPF_NORMAL}, {"value", 5, EPF_REFERENCE}};
+	void redis_append(mvProgram program, mvVariableHash parameters, mvVariable returnValue, void **pdata)
 	{
 		if (!isRedisEnabled(program, returnValue))
 		{
@@ -395,37 +5975,30 @@ extern "C"
 			return;
 		}
 
-		if (_redisAppendStackSize == 0)
-		{
-			mvVariable_SetValue_Integer(returnValue, 0);
-			return;
-		}
+		int keyLength = 0;
+		const char *key = mvVariable_Value(mvVariableHash_Index(parameters, 0), &keyLength);
+		forgetRedisCacheEntry(findRedisKeyEndpoint(key, keyLength), key, keyLength);
 
-		_redisAppendStackSize--;
+		int valueLength = 0;
+		const char *value = mvVariable_Value(mvVariableHash_Index(parameters, 1), &valueLength);
 
-		redisReply *reply;
-		if (redisGetReply(_connection, (void **)&reply) != REDIS_OK)
-		{
-			setRedisError(ERROR_COMMAND, _connection->errstr, program, returnValue);
+		const char *argv[] = {"APPEND", key, value};
+		const size_t argvlen[] = {6, (size_t)keyLength, (size_t)valueLength};
+		redisReply *reply = runRedisCommand(program, returnValue, 3, argv, argvlen);
+		if (reply == NULL)
 			return;
-		}
-
-		if (reply)
-		{
-			formatRedisReply(reply, mvVariableHash_Index(parameters, 0));
-			freeReplyObject(reply);
-		}
 
-		mvVariable_SetValue_Integer(returnValue, _redisAppendStackSize + 1);
+		freeReplyObject(reply);
+		mvVariable_SetValue_Integer(returnValue, 1);
 	}
 
 	/**
 	 * -----------------------------------------
-	 * Redis Command: GET
+	 * Redis Command: SET, from a file
 	 * -----------------------------------------
 	 */
-	MV_EL_FunctionParameter redis_get_parameters[] = {{"key", 3, EPF_NORMAL}, {"ret", 3, EPF_REFERENCE}};
-	void redis_get(mvProgram program, mvVariableHash parameters, mvVariable returnValue, void **pdata)
+	MV_EL_FunctionParameter redis_set_from_file_parameters[] = {{"key", 3, EPF_NORMAL}, {"location", 8, EPF_NORMAL}, {"path", 4, EPF_NORMAL}};
+	void redis_set_from_file(mvProgram program, mvVariableHash parameters, mvVariable returnValue, void **pdata)
 	{
 		if (!isRedisEnabled(program, returnValue))
 		{
@@ -441,47 +6014,96 @@ extern "C"
 
 		int keyLength = 0;
 		const char *key = mvVariable_Value(mvVariableHash_Index(parameters, 0), &keyLength);
-		redisReply *reply = (redisReply *)redisCommand(_connection, "GET %s", key);
 
-		if (reply == NULL)
+		int locationLength = 0;
+		const char *location = mvVariable_Value(mvVariableHash_Index(parameters, 1), &locationLength);
+
+		int pathLength = 0;
+		const char *path = mvVariable_Value(mvVariableHash_Index(parameters, 2), &pathLength);
+
+		int fileLocation;
+		if (locationLength == 4 && strncasecmp(location, "data", 4) == 0)
+			fileLocation = MVF_DATA;
+		else if (locationLength == 6 && strncasecmp(location, "script", 6) == 0)
+			fileLocation = MVF_SCRIPT;
+		else
 		{
-			setRedisError(ERROR_COMMAND, _connection->errstr, program, returnValue);
+			setRedisError(ERROR_MALFORMED_COMMAND, "Unknown file location, use data or script!", program, returnValue);
 			return;
 		}
 
-		if (reply->type == REDIS_REPLY_ERROR)
+		// The value is written straight to the socket of the server the key lives on
+		if (!routeRedisKey(program, returnValue, key, keyLength, false))
+			return;
+
+		mvFile file = mvFile_Open(program, fileLocation, path, pathLength, MVF_MODE_READ);
+		if (file == NULL)
 		{
-			setRedisError(ERROR_COMMAND, reply->str, program, returnValue);
-			freeReplyObject(reply);
+			setRedisError(ERROR_FILE, "Could not open " + string(path, pathLength) + "!", program, returnValue);
 			return;
 		}
 
-		if (reply->type == REDIS_REPLY_NIL)
+		forgetRedisCacheEntry(_endpoint, key, keyLength);
+
+		long fileLength = mvFile_Length(file);
+		if (!startRedisStreamCommand("SET", 3, key, keyLength, fileLength))
 		{
-			mvVariable_SetValue_Integer(returnValue, -1);
+			mvFile_Close(file);
+			setRedisConnectionError(program, returnValue);
 			return;
 		}
 
-		if (reply->type != REDIS_REPLY_STRING)
+		_streamBuffer.resize(STREAM_CHUNK_SIZE);
+		char *buffer = &_streamBuffer[0];
+		for (long remaining = fileLength; remaining > 0;)
 		{
-			setRedisError(ERROR_COMMAND, "Redis did not return with the proper type REDIS_REPLY_STRING", program, returnValue);
-			freeReplyObject(reply);
+			int count = mvFile_Read(file, buffer, remaining < (long)STREAM_CHUNK_SIZE ? remaining : STREAM_CHUNK_SIZE);
+			if (count <= 0)
+			{
+				// redis is still waiting for the rest of the value, so the connection is lost
+				mvFile_Close(file);
+				setRedisError(ERROR_FILE, "Could not read all of " + string(path, pathLength) + "!", program, returnValue);
+				freeRedisConnection(_endpoint);
+				return;
+			}
+
+			if (!writeRedisSocket(buffer, count))
+			{
+				mvFile_Close(file);
+				setRedisConnectionError(program, returnValue);
+				return;
+			}
+
+			remaining -= count;
+		}
+
+		mvFile_Close(file);
+
+		// Replies to earlier appended commands come first on the wire, set them aside
+		redisReply *reply = NULL;
+		if (!writeRedisSocket("\r\n", 2) ||
+			(!_endpoint->pendingReplies.empty() && !drainRedisReplies(_endpoint, true)) ||
+			redisGetReply(_connection, (void **)&reply) != REDIS_OK || reply == NULL)
+		{
+			setRedisConnectionError(program, returnValue);
 			return;
 		}
 
-		mvVariable_SetValue(mvVariableHash_Index(parameters, 1), reply->str, reply->len);
-		mvVariable_SetValue_Integer(returnValue, 1);
+		if (reply->type == REDIS_REPLY_ERROR)
+			setRedisError(ERROR_COMMAND, reply->str, program, returnValue);
+		else
+			mvVariable_SetValue_Integer(returnValue, 1);
 
 		freeReplyObject(reply);
 	}
 
 	/**
 	 * -----------------------------------------
-	 * Redis Command: DEL
+	 * Redis Command: APPEND, streamed
 	 * -----------------------------------------
 	 */
-	MV_EL_FunctionParameter redis_del_parameters[] = {{"key", 3, EPF_NORMAL}};
-	void redis_del(mvProgram program, mvVariableHash parameters, mvVariable returnValue, void **pdata)
+	MV_EL_FunctionParameter redis_append_stream_begin_parameters[] = {{"key", 3, EPF_NORMAL}};
+	void redis_append_stream_begin(mvProgram program, mvVariableHash parameters, mvVariable returnValue, void **pdata)
 	{
 		if (!isRedisEnabled(program, returnValue))
 		{
@@ -497,32 +6119,37 @@ extern "C"
 
 		int keyLength = 0;
 		const char *key = mvVariable_Value(mvVariableHash_Index(parameters, 0), &keyLength);
-		redisReply *reply = (redisReply *)redisCommand(_connection, "DEL %s", key);
 
-		if (reply == NULL)
-		{
-			setRedisError(ERROR_COMMAND, _connection->errstr, program, returnValue);
-			return;
-		}
+		// A stream left open is abandoned, its temporary key expires on its own
+		_appendStream.target = NULL;
+		_appendStream.id++;
+		_appendStream.failed = false;
+		_appendStream.key.assign(key, keyLength);
 
-		if (reply->type == REDIS_REPLY_ERROR)
-		{
-			setRedisError(ERROR_COMMAND, reply->str, program, returnValue);
-			freeReplyObject(reply);
+		// RENAME on a cluster needs both keys in one slot, tagging the whole key keeps them together
+		size_t tagLength;
+		if (findRedisHashTag(key, keyLength, &tagLength) == key && memchr(key, '}', keyLength) == NULL)
+			_appendStream.tempKey = "{" + _appendStream.key + "}";
+		else
+			_appendStream.tempKey = _appendStream.key;
+
+		char suffix[32];
+		_appendStream.tempKey.append(suffix, snprintf(suffix, sizeof(suffix), ":stream:%016llx", (unsigned long long)randomRedisNumber()));
+
+		char expires[16];
+		int expiresLength = snprintf(expires, sizeof(expires), "%d", STREAM_TEMP_KEY_TTL);
+
+		const char *argv[] = {"SET", _appendStream.tempKey.data(), "", "EX", expires};
+		const size_t argvlen[] = {3, _appendStream.tempKey.size(), 0, 2, (size_t)expiresLength};
+		if (!appendRedisCommand(program, returnValue, 5, argv, argvlen, false))
 			return;
-		}
 
-		freeReplyObject(reply);
+		_appendStream.target = _target;
 		mvVariable_SetValue_Integer(returnValue, 1);
 	}
 
-	/**
-	 * -----------------------------------------
-	 * Redis Command: SET
-	 * -----------------------------------------
-	 */
-	MV_EL_FunctionParameter redis_set_parameters[] = {{"key", 3, EPF_NORMAL}, {"value", 5, EPF_REFERENCE}};
-	void redis_set(mvProgram program, mvVariableHash parameters, mvVariable returnValue, void **pdata)
+	MV_EL_FunctionParameter redis_append_stream_parameters[] = {{"data", 4, EPF_REFERENCE}};
+	void redis_append_stream(mvProgram program, mvVariableHash parameters, mvVariable returnValue, void **pdata)
 	{
 		if (!isRedisEnabled(program, returnValue))
 		{
@@ -530,44 +6157,54 @@ extern "C"
 			return;
 		}
 
-		if (_connection == NULL)
+		if (_appendStream.target != _target || _connection == NULL)
 		{
-			setRedisError(ERROR_NOT_CONNECTED, "Not connected! Use redis_connect!", program, returnValue);
+			setRedisError(ERROR_MALFORMED_COMMAND, "No redis_append_stream_begin on this target!", program, returnValue);
 			return;
 		}
 
-		int keyLength = 0;
-		const char *key = mvVariable_Value(mvVariableHash_Index(parameters, 0), &keyLength);
+		if (!routeRedisKey(program, returnValue, _appendStream.tempKey.data(), _appendStream.tempKey.size(), false))
+			return;
 
-		int valueLength = 0;
-		const char *value = mvVariable_Value(mvVariableHash_Index(parameters, 1), &valueLength);
+		if (_appendStream.failed)
+		{
+			setRedisError(ERROR_COMMAND, "An earlier chunk of the stream was not appended!", program, returnValue);
+			return;
+		}
 
-		redisReply *reply = (redisReply *)redisCommand(_connection, "SET %s %s", key, value);
+		int dataLength = 0;
+		const char *data = mvVariable_Value(mvVariableHash_Index(parameters, 0), &dataLength);
+		if (dataLength == 0)
+		{
+			mvVariable_SetValue_Integer(returnValue, 1);
+			return;
+		}
 
-		if (reply == NULL)
+		// Written from the variable itself, hiredis never holds a copy of the chunk
+		if (!startRedisStreamCommand("APPEND", 6, _appendStream.tempKey.data(), _appendStream.tempKey.size(), dataLength) ||
+			!writeRedisSocket(data, dataLength) || !writeRedisSocket("\r\n", 2))
 		{
-			setRedisError(ERROR_COMMAND, _connection->errstr, program, returnValue);
+			_appendStream.target = NULL;
+			setRedisConnectionError(program, returnValue);
 			return;
 		}
 
-		if (reply->type == REDIS_REPLY_ERROR)
+		RedisPendingReply pending;
+		pending.wanted = false;
+		pending.stream = _appendStream.id;
+		_endpoint->pendingReplies.push_back(pending);
+		if (!drainRedisReplies(_endpoint, false))
 		{
-			setRedisError(ERROR_COMMAND, reply->str, program, returnValue);
-			freeReplyObject(reply);
+			_appendStream.target = NULL;
+			setRedisConnectionError(program, returnValue);
 			return;
 		}
 
-		freeReplyObject(reply);
 		mvVariable_SetValue_Integer(returnValue, 1);
 	}
 
-	/**
-	 * -----------------------------------------
-	 * Redis Command: APPEND
-	 * -----------------------------------------
-	 */
-	MV_EL_FunctionParameter redis_append_parameters[] = {{"key", 3, EPF_NORMAL}, {"value", 5, EPF_REFERENCE}};
-	void redis_append(mvProgram program, mvVariableHash parameters, mvVariable returnValue, void **pdata)
+	MV_EL_FunctionParameter redis_append_stream_end_parameters[] = {{"expires", 7, EPF_NORMAL}};
+	void redis_append_stream_end(mvProgram program, mvVariableHash parameters, mvVariable returnValue, void **pdata)
 	{
 		if (!isRedisEnabled(program, returnValue))
 		{
@@ -575,35 +6212,57 @@ extern "C"
 			return;
 		}
 
-		if (_connection == NULL)
+		if (_appendStream.target != _target || _connection == NULL)
 		{
-			setRedisError(ERROR_NOT_CONNECTED, "Not connected! Use redis_connect!", program, returnValue);
+			setRedisError(ERROR_MALFORMED_COMMAND, "No redis_append_stream_begin on this target!", program, returnValue);
 			return;
 		}
 
-		int keyLength = 0;
-		const char *key = mvVariable_Value(mvVariableHash_Index(parameters, 0), &keyLength);
-
-		int valueLength = 0;
-		const char *value = mvVariable_Value(mvVariableHash_Index(parameters, 1), &valueLength);
+		_appendStream.target = NULL;
 
-		redisReply *reply = (redisReply *)redisCommand(_connection, "APPEND %s %s", key, value);
+		// Every chunk's reply has to be in before deciding to rename
+		if (!routeRedisKey(program, returnValue, _appendStream.tempKey.data(), _appendStream.tempKey.size(), false))
+			return;
 
-		if (reply == NULL)
+		if (!drainRedisReplies(_endpoint, true))
 		{
-			setRedisError(ERROR_COMMAND, _connection->errstr, program, returnValue);
+			setRedisConnectionError(program, returnValue);
 			return;
 		}
 
-		if (reply->type == REDIS_REPLY_ERROR)
+		if (_appendStream.failed)
 		{
-			setRedisError(ERROR_COMMAND, reply->str, program, returnValue);
-			freeReplyObject(reply);
+			setRedisError(ERROR_COMMAND, "A chunk of the stream was not appended, the key was left unchanged!", program, returnValue);
 			return;
 		}
 
+		forgetRedisCacheEntry(findRedisKeyEndpoint(_appendStream.key.data(), _appendStream.key.size()), _appendStream.key.data(), _appendStream.key.size());
+
+		const char *renameArgv[] = {"RENAME", _appendStream.tempKey.data(), _appendStream.key.data()};
+		const size_t renameArgvlen[] = {6, _appendStream.tempKey.size(), _appendStream.key.size()};
+		redisReply *reply = runRedisCommand(program, returnValue, 3, renameArgv, renameArgvlen);
+		if (reply == NULL)
+			return;
+
 		freeReplyObject(reply);
+
+		// RENAME kept the temporary key's expiry
+		int expires = mvVariable_Value_Integer(mvVariableHash_Index(parameters, 0));
+
+		char expiresText[16];
+		int expiresLength = snprintf(expiresText, sizeof(expiresText), "%d", expires);
+
+		const char *expireArgv[] = {"EXPIRE", _appendStream.key.data(), expiresText};
+		const char *persistArgv[] = {"PERSIST", _appendStream.key.data()};
+		const size_t expireArgvlen[] = {6, _appendStream.key.size(), (size_t)expiresLength};
+		const size_t persistArgvlen[] = {7, _appendStream.key.size()};
+		reply = expires > 0 ? runRedisCommand(program, returnValue, 3, expireArgv, expireArgvlen) : runRedisCommand(program, returnValue, 2, persistArgv, persistArgvlen);
+		if (reply == NULL)
+			return;
+
 		mvVariable_SetValue_Integer(returnValue, 1);
+
+		freeReplyObject(reply);
 	}
 
 	/**
@@ -628,26 +6287,25 @@ extern "C"
 
 		int keyLength = 0;
 		const char *key = mvVariable_Value(mvVariableHash_Index(parameters, 0), &keyLength);
+		forgetRedisCacheEntry(findRedisKeyEndpoint(key, keyLength), key, keyLength);
 
 		int valueLength = 0;
 		const char *value = mvVariable_Value(mvVariableHash_Index(parameters, 1), &valueLength);
 
-		int expires = mvVariable_Value_Integer(mvVariableHash_Index(parameters, 2));
-
-		redisReply *reply = (redisReply *)redisCommand(_connection, "SETEX %s %d %s", key, expires, value);
-
-		if (reply == NULL)
+		if (compressRedisValue(value, valueLength, _compressBuffer))
 		{
-			setRedisError(ERROR_COMMAND, _connection->errstr, program, returnValue);
-			return;
+			value = _compressBuffer.data();
+			valueLength = _compressBuffer.size();
 		}
 
-		if (reply->type == REDIS_REPLY_ERROR)
-		{
-			setRedisError(ERROR_COMMAND, reply->str, program, returnValue);
-			freeReplyObject(reply);
+		char expires[16];
+		int expiresLength = snprintf(expires, sizeof(expires), "%d", mvVariable_Value_Integer(mvVariableHash_Index(parameters, 2)));
+
+		const char *argv[] = {"SETEX", key, expires, value};
+		const size_t argvlen[] = {5, (size_t)keyLength, (size_t)expiresLength, (size_t)valueLength};
+		redisReply *reply = runRedisCommand(program, returnValue, 4, argv, argvlen);
+		if (reply == NULL)
 			return;
-		}
 
 		freeReplyObject(reply);
 		mvVariable_SetValue_Integer(returnValue, 1);
@@ -661,19 +6319,44 @@ extern "C"
 	{
 		static MV_EL_Function exported_functions[] = {
 			{"spo_redis_is_enabled", 20, 0, redis_is_enabled_parameters, redis_is_enabled},
+			{"spo_redis_target", 16, 1, redis_target_parameters, redis_target},
 
 			{"spo_redis_free", 14, 0, redis_free_parameters, redis_free},
 			{"spo_redis_command", 17, 2, redis_command_parameters, redis_command},
 			{"spo_redis_command_append", 24, 2, redis_command_append_parameters, redis_command_append},
+			{"spo_redis_commandv", 18, 1, redis_commandv_parameters, redis_commandv},
+			{"spo_redis_commandv_append", 25, 1, redis_commandv_append_parameters, redis_commandv_append},
+			{"spo_redis_command_nowait", 24, 2, redis_command_nowait_parameters, redis_command_nowait},
+			{"spo_redis_commandv_nowait", 25, 1, redis_commandv_nowait_parameters, redis_commandv_nowait},
+			{"spo_redis_flush", 15, 0, redis_flush_parameters, redis_flush},
 			{"spo_redis_error", 15, 1, redis_error_parameters, redis_error},
 			{"spo_redis_error_clear", 21, 0, redis_error_clear_parameters, redis_error_clear},
 			{"spo_redis_get_reply", 19, 1, redis_get_reply_parameters, redis_get_reply},
+			{"spo_redis_pipeline_dropped", 26, 0, redis_pipeline_dropped_parameters, redis_pipeline_dropped},
+			{"spo_redis_flat_replies", 22, 1, redis_flat_replies_parameters, redis_flat_replies},
+			{"spo_redis_require_primary", 25, 1, redis_require_primary_parameters, redis_require_primary},
+			{"spo_redis_reply_type", 20, 0, redis_reply_type_parameters, redis_reply_type},
 
 			{"spo_redis_get", 13, 2, redis_get_parameters, redis_get},
+			{"spo_redis_get_output", 20, 1, redis_get_output_parameters, redis_get_output},
 			{"spo_redis_set", 13, 2, redis_set_parameters, redis_set},
 			{"spo_redis_setex", 15, 3, redis_setex_parameters, redis_setex},
 			{"spo_redis_del", 13, 1, redis_del_parameters, redis_del},
+			{"spo_redis_mget", 14, 3, redis_mget_parameters, redis_mget},
+			{"spo_redis_mset", 14, 1, redis_mset_parameters, redis_mset},
+			{"spo_redis_hset_struct", 21, 3, redis_hset_struct_parameters, redis_hset_struct},
+			{"spo_redis_hget_struct", 21, 3, redis_hget_struct_parameters, redis_hget_struct},
+			{"spo_redis_set_var", 17, 3, redis_set_var_parameters, redis_set_var},
+			{"spo_redis_get_var", 17, 2, redis_get_var_parameters, redis_get_var},
+			{"spo_redis_cache_fetch", 21, 4, redis_cache_fetch_parameters, redis_cache_fetch},
+			{"spo_redis_memoize", 17, 4, redis_memoize_parameters, redis_memoize},
+			{"spo_redis_output_cache_begin", 28, 2, redis_output_cache_begin_parameters, redis_output_cache_begin},
+			{"spo_redis_output_cache_end", 26, 1, redis_output_cache_end_parameters, redis_output_cache_end},
 			{"spo_redis_append", 16, 2, redis_append_parameters, redis_append},
+			{"spo_redis_set_from_file", 23, 3, redis_set_from_file_parameters, redis_set_from_file},
+			{"spo_redis_append_stream_begin", 29, 1, redis_append_stream_begin_parameters, redis_append_stream_begin},
+			{"spo_redis_append_stream", 23, 1, redis_append_stream_parameters, redis_append_stream},
+			{"spo_redis_append_stream_end", 27, 1, redis_append_stream_end_parameters, redis_append_stream_end},
 
 			{0, 0, 0, 0, 0}};
 
@@ -682,23 +6365,3 @@ extern "C"
 		return &list;
 	}
 }
-
-const char *getVariableFromLists(mvVariableList localVars, mvVariableList globalVars, const string &variableName)
-{
-	if (variableName.size() < 3)
-		return "";
-
-	mvVariable var = NULL;
-	if (variableName[0] == 'l' && variableName[1] == '.')
-		var = mvVariableList_Find(localVars, variableName.c_str() + 2, variableName.size() - 2);
-	else if (variableName[0] == 'g' && variableName[1] == '.')
-		var = mvVariableList_Find(globalVars, variableName.c_str() + 2, variableName.size() - 2);
-	else
-		return "";
-
-	if (var == NULL)
-		return "";
-
-	int len;
-	return mvVariable_Value(var, &len);
-}
\ No newline at end of file